@@ -0,0 +1,109 @@
+/*
+ *  Copyright (C) 2014 Philippe Groarke.
+ *  Author: Philippe Groarke <philippe.groarke@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+#ifndef AHOCORASICK_H
+#define AHOCORASICK_H
+
+#include <array>
+#include <cstdint>
+#include <queue>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/*
+ * Finds up to 64 patterns in one pass over the text. The trie and its
+ * failure links are flattened into a full transition table, so each byte
+ * is a single lookup. Bit i of matches() is pattern i.
+ */
+struct AhoCorasick {
+        AhoCorasick(const vector<string>& patterns)
+        {
+                newState();
+                for (size_t i = 0; i < patterns.size() && i < 64; ++i) {
+                        uint32_t s = 0;
+                        for (unsigned char c : patterns[i]) {
+                                if (next_[s][c] == 0) {
+                                        uint32_t n = newState();
+                                        next_[s][c] = n;
+                                }
+                                s = next_[s][c];
+                        }
+                        out_[s] |= uint64_t(1) << i;
+                }
+
+                // Breadth first, a state's failure is always done before it.
+                vector<uint32_t> fail(next_.size(), 0);
+                queue<uint32_t> todo;
+                for (int c = 0; c < 256; ++c) {
+                        if (next_[0][c] != 0)
+                                todo.push(next_[0][c]);
+                }
+                while (!todo.empty()) {
+                        uint32_t s = todo.front();
+                        todo.pop();
+                        out_[s] |= out_[fail[s]];
+                        for (int c = 0; c < 256; ++c) {
+                                uint32_t n = next_[s][c];
+                                if (n == 0) {
+                                        next_[s][c] = next_[fail[s]][c];
+                                } else {
+                                        fail[n] = next_[fail[s]][c];
+                                        todo.push(n);
+                                }
+                        }
+                }
+        }
+
+        uint32_t step(uint32_t state, unsigned char c) const
+        {
+                return next_[state][c];
+        }
+
+        // Patterns ending at this state.
+        uint64_t matches(uint32_t state) const { return out_[state]; }
+
+        // Every pattern found in the text.
+        uint64_t find(const char* s, size_t n) const
+        {
+                uint64_t ret = 0;
+                uint32_t state = 0;
+                for (size_t i = 0; i < n; ++i) {
+                        state = step(state, s[i]);
+                        ret |= out_[state];
+                }
+                return ret;
+        }
+
+        vector<array<uint32_t, 256> > next_;
+        vector<uint64_t> out_;
+
+private:
+        uint32_t newState()
+        {
+                array<uint32_t, 256> a;
+                a.fill(0);
+                next_.push_back(a);
+                out_.push_back(0);
+                return next_.size() - 1;
+        }
+};
+
+#endif // AHOCORASICK_H
@@ -0,0 +1,244 @@
+/*
+ *  Copyright (C) 2014 Philippe Groarke.
+ *  Author: Philippe Groarke <philippe.groarke@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <zlib.h>
+
+#include "spscqueue.hpp"
+
+using namespace std;
+
+const size_t INFLATE_CHUNK = 1 << 16;
+const size_t INFLATE_DEPTH = 8; // Chunks inflated ahead of the reader.
+
+// gzip magic bytes.
+inline bool isGzip(const char* data, size_t size)
+{
+        return size >= 2 && (unsigned char)data[0] == 0x1f
+                && (unsigned char)data[1] == 0x8b;
+}
+
+inline bool isGzipName(const string& f)
+{
+        return f.size() >= 3 && f.compare(f.size() - 3, 3, ".gz") == 0;
+}
+
+// A block compressed on its own, zlib format.
+inline string deflateBlock(const string& raw)
+{
+        uLongf size = compressBound(raw.size());
+        string ret(size, '\0');
+        compress2((Bytef*)&ret[0], &size, (const Bytef*)raw.data(), raw.size(),
+                Z_DEFAULT_COMPRESSION);
+        ret.resize(size);
+        return ret;
+}
+
+// False if the block is damaged or doesn't inflate to rawSize bytes.
+inline bool inflateBlock(const char* data, size_t size, size_t rawSize,
+        string& raw)
+{
+        // Past zlib's best ratio the size can only be damage.
+        if (rawSize > size * uint64_t(1032) + 64)
+                return false;
+
+        raw.resize(rawSize);
+        uLongf n = rawSize;
+        return uncompress((Bytef*)&raw[0], &n, (const Bytef*)data, size) == Z_OK
+                && n == rawSize;
+}
+
+/*
+ * Reads gzip through a streambuf. Inflating runs on its own thread a few
+ * chunks ahead of the reader. The input is either a buffer, a mapped file
+ * usually, or another stream like stdin. Concatenated gzip members are read
+ * one after the other, like gunzip does.
+ */
+struct GunzipBuffer : public streambuf {
+        GunzipBuffer(const char* data, size_t size) : chunks_(INFLATE_DEPTH)
+        {
+                worker_ = thread(&GunzipBuffer::inflateBuffer, this, data, size);
+        }
+
+        GunzipBuffer(istream& in) : chunks_(INFLATE_DEPTH)
+        {
+                worker_ = thread(&GunzipBuffer::inflateStream, this, ref(in));
+        }
+
+        ~GunzipBuffer()
+        {
+                chunks_.abandon();
+                worker_.join();
+        }
+
+        int_type underflow()
+        {
+                if (gptr() < egptr())
+                        return traits_type::to_int_type(*gptr());
+
+                if (!chunks_.pop(current_))
+                        return traits_type::eof();
+
+                char* p = &current_[0];
+                setg(p, p, p + current_.size());
+                return traits_type::to_int_type(*p);
+        }
+
+        // False if the input was damaged. Final once underflow() hit the end.
+        atomic_bool ok_{true};
+
+private:
+        void inflateBuffer(const char* data, size_t size)
+        {
+                z_stream z;
+                memset(&z, 0, sizeof(z));
+                inflateInit2(&z, 15 + 32);
+
+                // avail_in is 32 bits.
+                bool whole = true;
+                while (whole && size > 0) {
+                        uInt n = size < (1u << 30) ? size : (1u << 30);
+                        z.next_in = (Bytef*)data;
+                        z.avail_in = n;
+                        whole = inflateInput(z);
+                        data += n;
+                        size -= n;
+                }
+
+                endInflate(z, whole);
+        }
+
+        void inflateStream(istream& in)
+        {
+                z_stream z;
+                memset(&z, 0, sizeof(z));
+                inflateInit2(&z, 15 + 32);
+
+                string input(INFLATE_CHUNK, '\0');
+                bool whole = true;
+                while (whole && in.read(&input[0], input.size()).gcount() > 0) {
+                        z.next_in = (Bytef*)&input[0];
+                        z.avail_in = in.gcount();
+                        whole = inflateInput(z);
+                }
+
+                endInflate(z, whole);
+        }
+
+        // Input that stops inside a member was cut short.
+        void endInflate(z_stream& z, bool whole)
+        {
+                if (whole && z.total_in > 0) {
+                        cerr << "Truncated gzip input" << endl;
+                        ok_ = false;
+                }
+                inflateEnd(&z);
+                chunks_.close();
+        }
+
+        // Inflate all of avail_in, false once the reader gave up.
+        bool inflateInput(z_stream& z)
+        {
+                while (z.avail_in > 0) {
+                        string out(INFLATE_CHUNK, '\0');
+                        z.next_out = (Bytef*)&out[0];
+                        z.avail_out = out.size();
+
+                        int ret = inflate(&z, Z_NO_FLUSH);
+                        if (ret == Z_STREAM_END) {
+                                inflateReset(&z); // Next member, if any.
+                        } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+                                cerr << "Damaged gzip input" << endl;
+                                ok_ = false;
+                                z.avail_in = 0;
+                        }
+
+                        out.resize(out.size() - z.avail_out);
+                        if (!out.empty() && !chunks_.push(move(out)))
+                                return false;
+                }
+                return ok_.load();
+        }
+
+        SpscQueue<string> chunks_;
+        string current_;
+        thread worker_;
+};
+
+// Writes gzip to another stream. finish() must be called at the end.
+struct GzipBuffer : public streambuf {
+        GzipBuffer(ostream& out) :
+                out_(out),
+                buffer_(INFLATE_CHUNK, '\0'),
+                output_(INFLATE_CHUNK, '\0')
+        {
+                memset(&z_, 0, sizeof(z_));
+                deflateInit2(&z_, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16,
+                        8, Z_DEFAULT_STRATEGY);
+                setp(&buffer_[0], &buffer_[0] + buffer_.size());
+        }
+
+        ~GzipBuffer() { deflateEnd(&z_); }
+
+        int_type overflow(int_type c)
+        {
+                compress(Z_NO_FLUSH);
+                if (!traits_type::eq_int_type(c, traits_type::eof())) {
+                        *pptr() = traits_type::to_char_type(c);
+                        pbump(1);
+                }
+                return traits_type::not_eof(c);
+        }
+
+        void finish() { compress(Z_FINISH); }
+
+private:
+        void compress(int flush)
+        {
+                z_.next_in = (Bytef*)pbase();
+                z_.avail_in = pptr() - pbase();
+
+                int ret = Z_OK;
+                do {
+                        z_.next_out = (Bytef*)&output_[0];
+                        z_.avail_out = output_.size();
+                        ret = deflate(&z_, flush);
+                        out_.write(&output_[0], output_.size() - z_.avail_out);
+                } while (z_.avail_out == 0 || (flush == Z_FINISH
+                        && ret != Z_STREAM_END));
+
+                setp(&buffer_[0], &buffer_[0] + buffer_.size());
+        }
+
+        z_stream z_;
+        ostream& out_;
+        string buffer_; // What was written, not compressed yet.
+        string output_;
+};
+
+#endif // COMPRESSION_H
@@ -19,89 +19,284 @@
 #pragma once
 
 #include <stdio.h>
+#include <atomic>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <limits>
 #include <list>
 #include <map>
+#include <memory>
+#include <thread>
 #include <utility>
 #include <vector>
 
-#include "word.hpp"
+#include "compression.hpp"
+#include "frozenmodel.hpp"
+#include "hashmodel.hpp"
+#include "journal.hpp"
+#include "lazymodel.hpp"
+#include "mappedfile.hpp"
+#include "markovmodel.hpp"
+#include "model.hpp"
+#include "triemodel.hpp"
+#include "varint.hpp"
 
 using namespace std;
 
+/*
+ * "tree" and "hash" force a model. Otherwise common Markov lengths get a
+ * model compiled for them, the rest use the tree.
+ */
+inline unique_ptr<Model> makeModel(int markovLength, const string& type = "")
+{
+        if (type == "tree")
+                return unique_ptr<Model>(new TrieModel(markovLength));
+        if (type == "hash")
+                return unique_ptr<Model>(new HashModel(markovLength));
+
+        switch (markovLength) {
+                case 2: return unique_ptr<Model>(new MarkovModel<2>());
+                case 3: return unique_ptr<Model>(new MarkovModel<3>());
+                case 4: return unique_ptr<Model>(new MarkovModel<4>());
+                case 5: return unique_ptr<Model>(new MarkovModel<5>());
+                default: return unique_ptr<Model>(new TrieModel(markovLength));
+        }
+}
+
 struct Database {
 
-        Database() {}
+        Database() : in_(&buffer_) {}
 
+        // The input file is mapped and read in place, never copied. gzip is
+        // inflated on the fly.
         friend istream& operator>>(istream& is, Database& db) {
+                if (db.file_.is_open()) {
+                        db.in_.setstate(ios::eofbit | ios::failbit);
+                        return db.in_;
+                }
 
-                ifstream ifs;
-                ifs.open(db.inputFilename_, ios::in | ios::binary);
-
-                if (!ifs.is_open()) {
+                if (!db.file_.open(db.inputFilename_)) {
                         cout << "Couldn't read " << db.inputFilename_ << endl;
                         return is;
                 }
 
-                db.ss << ifs.rdbuf();
-
-                ifs.close();
-                return db.ss;
+                if (isGzip(db.file_.data(), db.file_.size())) {
+                        db.gunzip_.reset(new GunzipBuffer(db.file_.data(),
+                                db.file_.size()));
+                        db.in_.rdbuf(db.gunzip_.get());
+                } else {
+                        db.buffer_.set(db.file_.data(), db.file_.size());
+                        db.in_.rdbuf(&db.buffer_);
+                }
+                db.in_.clear();
+                return db.in_;
         }
 
-        unique_ptr<map<string, unique_ptr<Word> > > loadFile(int& markovLength, string f = "data.dsmc")
+        unique_ptr<Model> loadFile(int& markovLength, string f = "data.dsmc")
         {
-                unique_ptr<map<string, unique_ptr<Word> > > myMap(
-                                new map<string, unique_ptr<Word> >);
-
                 ifstream ifs;
-                string backupFile = f;
-                backupFile.insert(0, ".");
-                backupFile += ".bak";
+                string backupFile = backupName(f);
 
+                string name = backupFile;
                 ifs.open(backupFile, ios::in | ios::binary);
                 if (!ifs.good()) {
+                        name = f;
                         ifs.open(f, ios::in | ios::binary);
                 }
 
                 if (!ifs.is_open()) {
                         cout << "Couldn't load " << f << endl;
-                        return move(myMap);
+                        unique_ptr<Model> model = makeModel(markovLength,
+                                modelType_);
+                        replay(*model, f, false);
+                        return model;
                 }
 
-                ifs >> markovLength;
-                size_t mapSize = 0;
-                ifs >> mapSize;
-                cout << "Current database size: " << mapSize << endl;
+                char magic[sizeof(FROZEN_MAGIC)] = {};
+                ifs.read(magic, sizeof(magic));
+                ifs.clear();
+                ifs.seekg(0);
+                snapshotSize_ = fileSize(name);
+                if (memcmp(magic, FROZEN_MAGIC, sizeof(magic)) == 0)
+                        return loadFrozen(markovLength, f, name);
 
-                for (int i = 0; i < mapSize; ++i) {
-                        string tempKey;
-                        unique_ptr<Word> tempWord(new Word());
-                        ifs >> tempKey >> *tempWord;
-                        myMap->insert(
-                                pair<string, unique_ptr<Word> >(tempKey, move(tempWord)));
+                // Generating only, contexts are read as they are used.
+                if (readOnly_ && memcmp(magic, DSMC_MAGIC, 4) == 0
+                && !journaled(f, name)) {
+                        unique_ptr<LazyModel> lazy(new LazyModel());
+                        if (lazy->open(name)) {
+                                markovLength = lazy->order();
+                                cout << "Current database size: " << lazy->size()
+                                        << endl;
+                                return lazy;
+                        }
                 }
 
-                for (auto& x : *myMap)
-                        x.second->printInfo();
+                // Compressed databases are read as they inflate.
+                unique_ptr<GunzipBuffer> gunzip;
+                unique_ptr<istream> gz;
+                if (ifs.peek() == 0x1f) {
+                        gunzip.reset(new GunzipBuffer(ifs));
+                        gz.reset(new istream(gunzip.get()));
+                }
+                istream& is = gz ? *gz : ifs;
+
+                // Text databases from before the binary format still load.
+                unique_ptr<Model> model;
+                bool damaged = false;
+                if (is.peek() == DSMC_MAGIC[0]) {
+                        uint64_t version = 0;
+                        model = readHeader(is, markovLength, version);
+                        if (!model) {
+                                cout << "Couldn't load " << f << endl;
+                                return makeModel(markovLength, modelType_);
+                        }
+                        damaged = !model->readBinary(is, version);
+                } else {
+                        is >> markovLength;
+                        model = makeModel(markovLength, modelType_);
+
+                        // A text edge is at least a few dozen bytes.
+                        if (!gz) {
+                                streampos start = ifs.tellg();
+                                ifs.seekg(0, ios::end);
+                                model->reserve(size_t(ifs.tellg()) / 32);
+                                ifs.seekg(start);
+                        }
+
+                        model->read(is);
+                }
+
+                // A cut gzip member only shows once the stream is read out.
+                if (gunzip) {
+                        is.clear();
+                        is.ignore(numeric_limits<streamsize>::max());
+                        damaged = damaged || !gunzip->ok_;
+                }
+                if (damaged)
+                        cout << "Database " << f << " is damaged" << endl;
+                replay(*model, f, name != f);
+                cout << "Current database size: " << model->size() << endl;
 
                 ifs.close();
-                return move(myMap);
+                return model;
+        }
+
+        // Chains learned from now on are appended to f's journal.
+        bool openJournal(const string& f)
+        {
+                return journal_.open(f + ".journal");
+        }
+
+        /*
+         * Make what was learned durable. Only the journal is written until it
+         * outgrows half the snapshot, then the snapshot is redone in the
+         * background. m can't change until this returns.
+         */
+        void checkpoint(unique_ptr<Model>& m, int markovLength, string f)
+        {
+                journal_.flush();
+                if (saving_)
+                        return;
+                if (!journal_.is_open() || journal_.size() * 2 > snapshotSize_)
+                        saveInBackground(m, markovLength, f);
+        }
+
+        void save(unique_ptr<Model>& m, int markovLength, string f = "data.dsmc")
+        {
+                wait();
+                begin(f);
+                write(*m, markovLength, f);
+        }
+
+        /*
+         * Save a copy of m from another thread, learning and speaking go on
+         * meanwhile. m can't change while it is copied.
+         *
+         * The copy is made on the caller's thread. It's a few flat vectors
+         * and takes a small part of the time the write does, and replies
+         * read the other copy of the ModelPair meanwhile. Learning waits
+         * for it once per snapshot.
+         */
+        void saveInBackground(unique_ptr<Model>& m, int markovLength, string f)
+        {
+                wait();
+                begin(f);
+                shared_ptr<Model> snapshot = m->clone();
+                saving_ = true;
+                saver_ = thread([this, snapshot, markovLength, f]() {
+                        write(*snapshot, markovLength, f);
+                        saving_ = false;
+                });
+        }
+
+        // Until the last save is on disk.
+        void wait()
+        {
+                if (saver_.joinable())
+                        saver_.join();
         }
 
-        void save(unique_ptr<map<string, unique_ptr<Word> > >& l, int markovLength, string f = "data.dsmc")
+        ~Database() { wait(); }
+
+        string inputFilename_;
+        string modelType_;
+        MappedFile file_;
+        MemoryBuffer buffer_;
+        unique_ptr<GunzipBuffer> gunzip_;
+        istream in_;
+        bool readOnly_ = false; // Nothing will learn, the model may stay on disk.
+        Journal journal_;
+        atomic<uint64_t> snapshotSize_{0};
+        atomic_bool saving_{false};
+        thread saver_;
+
+private:
+        static string backupName(const string& f)
+        {
+                string ret = f;
+                ret.insert(0, ".");
+                return ret + ".bak";
+        }
+
+        /*
+         * Everything on disk is switched over before the snapshot is written.
+         * Until write() is done, loading takes the backup and both journals.
+         * A backup still there is from a save that didn't finish, it stays
+         * and f, maybe cut short, is written over.
+         */
+        void begin(const string& f)
         {
                 cout << "Saving database " << f << endl;
-                string backupName = f;
-                backupName.insert(0, ".");
-                backupName += ".bak";
 
                 // Backup db in case stuff breaks
-                if (rename(f.c_str(), backupName.c_str()) != 0) {
-                        cerr << "Error renaming file " << backupName << endl;
+                string backup = backupName(f);
+                string journalName = f + ".journal";
+                if (ifstream(backup).is_open()) {
+                        cerr << "Keeping backup " << backup << endl;
+                } else {
+                        // f already holds an old journal left without its
+                        // backup, by a save that stopped between the two.
+                        remove((journalName + ".old").c_str());
+                        if (rename(f.c_str(), backup.c_str()) != 0)
+                                cerr << "Error renaming file " << backup << endl;
                 }
 
+                // The snapshot will hold what the journal does. Keep it until
+                // the snapshot is whole, new chains go to a new journal. An
+                // old journal left by a failed save gets this one's records.
+                journal_.flush();
+                if (!Journal::append(journalName, journalName + ".old")
+                && Journal::exists(journalName))
+                        cerr << "Error keeping journal " << journalName << endl;
+                if (journal_.is_open())
+                        journal_.open(journalName);
+        }
+
+        // The backup and the old journal go once the snapshot is whole.
+        void write(const Model& m, int markovLength, const string& f)
+        {
                 ofstream ofs;
                 ofs.open(f, ios::out | ios::binary);
 
@@ -110,16 +305,98 @@ struct Database {
                         return;
                 }
 
-                ofs << markovLength << endl;
-                ofs << l->size() << endl;
-                for (auto& x : *l) {
-                        ofs << x.first << endl << *x.second;
+                // Frozen when the name ends in .dsmm, compressed for .gz.
+                if (isFrozenName(f)) {
+                        FrozenModel::write(m, ofs);
+                } else if (isGzipName(f)) {
+                        GzipBuffer gz(ofs);
+                        ostream os(&gz);
+                        writeHeader(os, markovLength);
+                        m.writeBinary(os);
+                        os.flush();
+                        gz.finish();
+                } else {
+                        writeHeader(ofs, markovLength);
+                        m.writeBinary(ofs);
                 }
 
-                remove(backupName.c_str());
                 ofs.close();
+                if (!ofs) {
+                        cout << "Couldn't save " << f << endl;
+                        return;
+                }
+                remove(backupName(f).c_str());
+                remove((f + ".journal.old").c_str());
+                snapshotSize_ = fileSize(f);
         }
 
-        string inputFilename_;
-        stringstream ss;
+        // Mapped as is when possible, otherwise copied into a model.
+        unique_ptr<Model> loadFrozen(int& markovLength, const string& f,
+                const string& name)
+        {
+                unique_ptr<FrozenModel> frozen(new FrozenModel());
+                if (!frozen->open(name)) {
+                        cout << "Couldn't load " << name << endl;
+                        return makeModel(markovLength, modelType_);
+                }
+
+                markovLength = frozen->order();
+                if (readOnly_ && frozen->direct() && !journaled(f, name)) {
+                        cout << "Current database size: " << frozen->size() << endl;
+                        return frozen;
+                }
+
+                unique_ptr<Model> model = makeModel(markovLength, modelType_);
+                frozen->copyTo(*model);
+                replay(*model, f, name != f);
+                cout << "Current database size: " << model->size() << endl;
+                return model;
+        }
+
+        // Something was learned after the snapshot name holds.
+        bool journaled(const string& f, const string& name)
+        {
+                return Journal::exists(f + ".journal")
+                        || (name != f && Journal::exists(f + ".journal.old"));
+        }
+
+        /*
+         * Learn what came after the snapshot. A save that didn't finish
+         * left the journal it was replacing next to the backup.
+         */
+        void replay(Model& m, const string& f, bool fromBackup)
+        {
+                if (fromBackup)
+                        Journal::replay(f + ".journal.old", &m);
+                Journal::replay(f + ".journal", &m);
+        }
+
+        void writeHeader(ostream& os, int markovLength)
+        {
+                os.write(DSMC_MAGIC, 4);
+                writeVarint(os.rdbuf(), DSMC_VERSION);
+                writeVarint(os.rdbuf(), markovLength);
+        }
+
+        // An empty model for the Markov length in the header, if it is sane.
+        unique_ptr<Model> readHeader(istream& is, int& markovLength,
+                uint64_t& version)
+        {
+                char magic[4];
+                uint64_t length = 0;
+                streambuf* sb = is.rdbuf();
+                if (sb->sgetn(magic, 4) != 4 || memcmp(magic, DSMC_MAGIC, 4) != 0
+                || !readVarint(sb, version) || !readVarint(sb, length)
+                || length == 0 || length > MAX_MARKOV_LENGTH)
+                        return nullptr;
+
+                if (version > DSMC_VERSION) {
+                        cout << "Database version " << version
+                                << " is newer than this program" << endl;
+                        return nullptr;
+                }
+
+                markovLength = length;
+                return makeModel(markovLength, modelType_);
+        }
 };
@@ -0,0 +1,274 @@
+/*
+ *  Copyright (C) 2014 Philippe Groarke.
+ *  Author: Philippe Groarke <philippe.groarke@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+#ifndef FILEPOOL_H
+#define FILEPOOL_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <dirent.h>
+#include <glob.h>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <vector>
+
+#include "compression.hpp"
+#include "gutenbergparser.hpp"
+#include "mappedfile.hpp"
+#include "paralleltrainer.hpp"
+#include "reader.hpp"
+#include "word.hpp"
+
+using namespace std;
+
+inline bool isDirectory(const string& path)
+{
+        struct stat st;
+        return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+// Every regular file under a directory, at any depth.
+inline void listDirectory(const string& dir, vector<string>& files)
+{
+        DIR* d = opendir(dir.c_str());
+        if (d == nullptr)
+                return;
+
+        while (dirent* x = readdir(d)) {
+                string name = x->d_name;
+                if (name == "." || name == "..")
+                        continue;
+
+                string path = dir + "/" + name;
+                if (isDirectory(path))
+                        listDirectory(path, files);
+                else
+                        files.push_back(path);
+        }
+        closedir(d);
+}
+
+/*
+ * The files named by --file: a file, a directory or a glob. Sorted, so
+ * learning the same set gives the same database.
+ */
+inline vector<string> listInput(const string& input)
+{
+        vector<string> ret;
+        if (isDirectory(input)) {
+                listDirectory(input, ret);
+        } else if (input.find_first_of("*?[") != string::npos) {
+                glob_t g;
+                if (glob(input.c_str(), 0, nullptr, &g) == 0) {
+                        for (size_t i = 0; i < g.gl_pathc; ++i) {
+                                if (isDirectory(g.gl_pathv[i]))
+                                        listDirectory(g.gl_pathv[i], ret);
+                                else
+                                        ret.push_back(g.gl_pathv[i]);
+                        }
+                }
+                globfree(&g);
+        } else {
+                ret.push_back(input);
+        }
+
+        sort(ret.begin(), ret.end());
+        return ret;
+}
+
+// Files per worker that may be read ahead of the one being learned.
+const size_t FILEPOOL_AHEAD = 2;
+
+/*
+ * Learns many files at once. Workers clean and tokenize whole files against
+ * private symbol tables, each taking from its own queue and stealing from
+ * the others when it runs dry. The calling thread feeds the results to
+ * Reader in file order, so the database doesn't depend on the number of
+ * threads. Every file is its own text, chains stop at its end.
+ *
+ * Workers only take files within FILEPOOL_AHEAD per worker of the next one
+ * to learn, so a slow file holds back at most that many finished ones.
+ */
+struct FilePool {
+        FilePool(int threads, bool gutenberg) :
+                threads_(threads < 1 ? 1 : threads),
+                gutenberg_(gutenberg)
+        {}
+
+        void train(Reader& reader, const vector<string>& files)
+        {
+                jobs_.clear();
+                queues_.clear();
+                learned_ = 0;
+                for (size_t i = 0; i < files.size(); ++i) {
+                        jobs_.push_back(unique_ptr<Job>(new Job()));
+                        jobs_.back()->path = files[i];
+                }
+
+                // Round robin, so the first files are worked on first.
+                for (int t = 0; t < threads_; ++t)
+                        queues_.push_back(unique_ptr<Queue>(new Queue()));
+                for (size_t i = 0; i < files.size(); ++i)
+                        queues_[i % threads_]->jobs.push_back(i);
+
+                vector<thread> pool;
+                for (int t = 0; t < threads_; ++t)
+                        pool.push_back(thread(&FilePool::work, this, t));
+
+                for (auto& x : jobs_) {
+                        {
+                                unique_lock<mutex> lk(mutex_);
+                                done_.wait(lk, [&x]() { return x->done; });
+                        }
+                        learn(reader, *x);
+                        x.reset();
+
+                        lock_guard<mutex> lk(mutex_);
+                        ++learned_;
+                        done_.notify_all();
+                }
+
+                for (auto& t : pool)
+                        t.join();
+        }
+
+        struct Job {
+                string path;
+                Symbols symbols; // Local ids, in order of appearance.
+                vector<uint32_t> ids;
+                bool done = false;
+        };
+
+        struct Queue {
+                mutex lock;
+                deque<size_t> jobs;
+        };
+
+        void work(int self)
+        {
+                size_t job = 0;
+                while (take(self, job)) {
+                        Job& x = *jobs_[job];
+                        MappedFile file(x.path);
+                        const char* data = file.data();
+                        size_t size = file.size();
+
+                        // Compressed files are inflated whole, the worker
+                        // owns them until they are tokenized anyway.
+                        string raw;
+                        if (file.is_open() && isGzip(data, size)) {
+                                GunzipBuffer gunzip(data, size);
+                                ostringstream ss;
+                                ss << &gunzip;
+                                raw = ss.str();
+                                if (!gunzip.ok_)
+                                        cout << x.path << " is damaged" << endl;
+                                data = raw.data();
+                                size = raw.size();
+                        }
+
+                        if (!file.is_open()) {
+                                cout << "Couldn't read " << x.path << endl;
+                        } else if (gutenberg_) {
+                                MemoryBuffer buffer;
+                                buffer.set(data, size);
+                                istream in(&buffer);
+                                GutenbergParser gp;
+                                string text;
+                                gp.parse(in, [&text](const string& line) {
+                                        text += line;
+                                        text += ' ';
+                                });
+                                ParallelTrainer::tokenize(text.data(),
+                                        text.data() + text.size(), x.symbols, x.ids);
+                        } else {
+                                ParallelTrainer::tokenize(data, data + size,
+                                        x.symbols, x.ids);
+                        }
+
+                        lock_guard<mutex> lk(mutex_);
+                        x.done = true;
+                        done_.notify_all();
+                }
+        }
+
+        /*
+         * Own queue first, then the others. The oldest file of a queue is
+         * taken, if it isn't too far ahead of learning, otherwise wait for
+         * learning to move on. False once every queue is empty.
+         */
+        bool take(int self, size_t& job)
+        {
+                for (;;) {
+                        size_t learned = 0;
+                        {
+                                lock_guard<mutex> lk(mutex_);
+                                learned = learned_;
+                        }
+
+                        bool left = false;
+                        for (int i = 0; i < threads_; ++i) {
+                                Queue& q = *queues_[(self + i) % threads_];
+                                lock_guard<mutex> lk(q.lock);
+                                if (q.jobs.empty())
+                                        continue;
+
+                                left = true;
+                                if (q.jobs.front() < learned + threads_ * FILEPOOL_AHEAD) {
+                                        job = q.jobs.front();
+                                        q.jobs.pop_front();
+                                        return true;
+                                }
+                        }
+                        if (!left)
+                                return false;
+
+                        unique_lock<mutex> lk(mutex_);
+                        done_.wait(lk, [&]() { return learned_ != learned; });
+                }
+        }
+
+        void learn(Reader& reader, const Job& x)
+        {
+                vector<Word> remap(x.symbols.size());
+                for (uint32_t id = 0; id < remap.size(); ++id) {
+                        remap[id].id_ = symbols().intern(x.symbols.str(id));
+                        reader.addCharacteristics(remap[id]);
+                }
+
+                for (auto id : x.ids)
+                        reader.addWord(remap[id]);
+                reader.generateMainTree();
+        }
+
+        int threads_;
+        bool gutenberg_;
+        vector<unique_ptr<Job> > jobs_;
+        vector<unique_ptr<Queue> > queues_;
+        size_t learned_ = 0; // Files given to Reader so far.
+        mutex mutex_;
+        condition_variable done_;
+};
+
+#endif // FILEPOOL_H
@@ -0,0 +1,409 @@
+/*
+ *  Copyright (C) 2014 Philippe Groarke.
+ *  Author: Philippe Groarke <philippe.groarke@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+#ifndef FROZENMODEL_H
+#define FROZENMODEL_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "mappedfile.hpp"
+#include "model.hpp"
+#include "triemodel.hpp"
+#include "word.hpp"
+
+using namespace std;
+
+const char FROZEN_MAGIC[8] = {'D', 'S', 'M', 'C', 'M', 'A', 'P', '\0'};
+const uint32_t FROZEN_VERSION = 1;
+
+inline bool isFrozenName(const string& f)
+{
+        return f.size() >= 5 && f.compare(f.size() - 5, 5, ".dsmm") == 0;
+}
+
+/*
+ * A read only model file used straight from its mapping. Sections are
+ * found by offset from the start of the file and 8 byte aligned, so any
+ * number of processes can share the same pages.
+ *
+ *   tokens      numTokens + 1 uint64_t, where each string starts in text
+ *   text        the token strings, back to back
+ *   nodes       Range per node, node 0 is the root
+ *   edges       Edge, sorted by token within a node, child is a node
+ *   cumulative  uint64_t per edge, running sum of the weights of a node
+ *
+ * Tokens are stored in id order, so once interned in a fresh symbol
+ * table their ids are the ones in the file and the edges need no change.
+ */
+struct FrozenModel : public Model {
+        struct Header {
+                char magic[8];
+                uint32_t version;
+                uint32_t order;
+                uint32_t numTokens;
+                uint32_t numNodes;
+                uint64_t numEdges;
+                uint64_t tokens;
+                uint64_t text;
+                uint64_t nodes;
+                uint64_t edges;
+                uint64_t cumulative;
+                uint64_t size;
+        };
+
+        struct Range {
+                uint32_t first;
+                uint32_t size;
+        };
+
+        static bool isFrozen(const char* data, size_t size)
+        {
+                return size >= sizeof(Header)
+                        && memcmp(data, FROZEN_MAGIC, sizeof(FROZEN_MAGIC)) == 0;
+        }
+
+        // False if the file isn't a frozen model or doesn't add up.
+        bool open(const string& f)
+        {
+                if (!file_.open(f, MADV_RANDOM)
+                || !isFrozen(file_.data(), file_.size()))
+                        return false;
+
+                const Header& h = header();
+                if (h.version > FROZEN_VERSION) {
+                        cout << "Model version " << h.version
+                                << " is newer than this program" << endl;
+                        return false;
+                }
+                if (h.size != file_.size() || h.order == 0 || h.numNodes == 0
+                || !fits(h.tokens, (h.numTokens + uint64_t(1)) * 8)
+                || !fits(h.nodes, uint64_t(h.numNodes) * sizeof(Range))
+                || !fits(h.edges, h.numEdges * sizeof(Edge))
+                || !fits(h.cumulative, h.numEdges * 8))
+                        return false;
+
+                tokens_ = (const uint64_t*)(file_.data() + h.tokens);
+                nodes_ = (const Range*)(file_.data() + h.nodes);
+                edges_ = (const Edge*)(file_.data() + h.edges);
+                cumulative_ = (const uint64_t*)(file_.data() + h.cumulative);
+                if (!fits(h.text, tokens_[h.numTokens]))
+                        return false;
+
+                // Only the strings are copied.
+                const char* text = file_.data() + h.text;
+                ids_.resize(h.numTokens);
+                direct_ = true;
+                for (uint32_t i = 0; i < h.numTokens; ++i) {
+                        if (tokens_[i] > tokens_[i + 1])
+                                return false;
+                        ids_[i] = symbols().intern(text + tokens_[i],
+                                tokens_[i + 1] - tokens_[i]);
+                        direct_ = direct_ && ids_[i] == i;
+                }
+                return valid();
+        }
+
+        /*
+         * Edges hold the ids of the file. They are the process' own unless
+         * something was interned before the model was opened, the model
+         * then has to be copied with copyTo().
+         */
+        bool direct() const { return direct_; }
+
+        // Add every count to a model that can learn, with the process' ids.
+        void copyTo(Model& to) const
+        {
+                vector<uint32_t> path;
+                copyNode(to, 0, path);
+        }
+
+        int order() const { return header().order; }
+
+        // Read only, the Database thaws it before anything learns.
+        void addChain(const vector<const Word*>& window) {}
+        void add(const uint32_t* context, size_t n, uint32_t token,
+                uint32_t weight, uint32_t flags) {}
+        void remove(const uint32_t* context, size_t n, uint32_t token) {}
+        void decaySlice(float factor, uint32_t threshold, size_t work) {}
+        void prepare() {}
+
+        bool successors(const uint32_t* context, size_t n,
+                const Edge*& begin, const Edge*& end) const
+        {
+                uint32_t node = find(context, n);
+                if (node == NPOS)
+                        return false;
+
+                begin = edges_ + nodes_[node].first;
+                end = begin + nodes_[node].size;
+                return true;
+        }
+
+        // Writes nothing, so any number of threads can sample at once.
+        const Edge* sample(const uint32_t* context, size_t n, mt19937& gen)
+        {
+                uint32_t node = find(context, n);
+                if (node == NPOS || nodes_[node].size == 0)
+                        return nullptr;
+
+                const Range& r = nodes_[node];
+                const uint64_t* c = cumulative_ + r.first;
+                uint64_t total = c[r.size - 1];
+                if (total == 0)
+                        return nullptr;
+
+                uniform_int_distribution<uint64_t> distribution(0, total - 1);
+                const uint64_t* it = upper_bound(c, c + r.size,
+                        distribution(gen));
+                return edges_ + r.first + (it - c);
+        }
+
+        uint32_t weight(const uint32_t* context, size_t n, uint32_t token) const
+        {
+                uint32_t node = find(context, n);
+                if (node == NPOS)
+                        return 0;
+
+                const Edge* e = findEdge(node, token);
+                return e == nullptr ? 0 : e->weight;
+        }
+
+        size_t numSuccessors(const uint32_t* context, size_t n) const
+        {
+                uint32_t node = find(context, n);
+                return node == NPOS ? 0 : nodes_[node].size;
+        }
+
+        // The mapping belongs to the page cache.
+        size_t memory() const { return ids_.capacity() * sizeof(uint32_t); }
+
+        // The copy can learn.
+        unique_ptr<Model> clone() const
+        {
+                unique_ptr<Model> ret(new TrieModel(order()));
+                copyTo(*ret);
+                return ret;
+        }
+
+        /*
+         * Lay out any model as a frozen file. Needs about the size of the
+         * file in memory while it runs.
+         */
+        static void write(const Model& m, ostream& os)
+        {
+                // Used tokens, kept in id order.
+                vector<uint32_t> path;
+                vector<uint32_t> local;
+                markTokens(m, path, local);
+
+                vector<uint64_t> tokens(1, 0);
+                string text;
+                uint32_t numTokens = 0;
+                for (uint32_t id = 0; id < local.size(); ++id) {
+                        if (local[id] == NPOS)
+                                continue;
+                        local[id] = numTokens++;
+                        text += symbols().str(id);
+                        tokens.push_back(text.size());
+                }
+
+                vector<Range> nodes;
+                vector<Edge> edges;
+                vector<uint64_t> cumulative;
+                freezeNode(m, path, local, nodes, edges, cumulative);
+
+                Header h;
+                memset(&h, 0, sizeof(h));
+                memcpy(h.magic, FROZEN_MAGIC, sizeof(h.magic));
+                h.version = FROZEN_VERSION;
+                h.order = m.order();
+                h.numTokens = numTokens;
+                h.numNodes = nodes.size();
+                h.numEdges = edges.size();
+                h.tokens = sizeof(Header);
+                h.text = h.tokens + tokens.size() * 8;
+                h.nodes = align(h.text + text.size());
+                h.edges = align(h.nodes + nodes.size() * sizeof(Range));
+                h.cumulative = align(h.edges + edges.size() * sizeof(Edge));
+                h.size = h.cumulative + cumulative.size() * 8;
+
+                os.write((const char*)&h, sizeof(h));
+                os.write((const char*)tokens.data(), tokens.size() * 8);
+                os.write(text.data(), text.size());
+                pad(os, h.nodes - (h.text + text.size()));
+                os.write((const char*)nodes.data(), nodes.size() * sizeof(Range));
+                pad(os, h.edges - (h.nodes + nodes.size() * sizeof(Range)));
+                os.write((const char*)edges.data(), edges.size() * sizeof(Edge));
+                pad(os, h.cumulative - (h.edges + edges.size() * sizeof(Edge)));
+                os.write((const char*)cumulative.data(), cumulative.size() * 8);
+        }
+
+        MappedFile file_;
+        const uint64_t* tokens_ = nullptr;
+        const Range* nodes_ = nullptr;
+        const Edge* edges_ = nullptr;
+        const uint64_t* cumulative_ = nullptr;
+        vector<uint32_t> ids_; // File token to process token.
+        bool direct_ = false;
+
+private:
+        const Header& header() const { return *(const Header*)file_.data(); }
+
+        bool fits(uint64_t offset, uint64_t size) const
+        {
+                return offset % 8 == 0 && offset <= file_.size()
+                        && size <= file_.size() - offset;
+        }
+
+        /*
+         * Every node range and edge is checked once, so lookups and the
+         * token strings of generated words can trust the file.
+         */
+        bool valid() const
+        {
+                const Header& h = header();
+                for (uint32_t i = 0; i < h.numNodes; ++i) {
+                        if (nodes_[i].first + uint64_t(nodes_[i].size)
+                                        > h.numEdges)
+                                return false;
+                }
+                for (uint64_t i = 0; i < h.numEdges; ++i) {
+                        if (edges_[i].token >= h.numTokens
+                        || (edges_[i].child != NPOS
+                                && edges_[i].child >= h.numNodes))
+                                return false;
+                }
+                return true;
+        }
+
+        // Follow a path of tokens from the root, returns the node or NPOS.
+        uint32_t find(const uint32_t* path, size_t n) const
+        {
+                uint32_t node = 0;
+                for (size_t i = 0; i < n; ++i) {
+                        const Edge* e = findEdge(node, path[i]);
+                        if (e == nullptr || e->child == NPOS)
+                                return NPOS;
+                        node = e->child;
+                }
+                return node;
+        }
+
+        const Edge* findEdge(uint32_t node, uint32_t tok) const
+        {
+                const Range& r = nodes_[node];
+                const Edge* b = edges_ + r.first;
+                const Edge* e = b + r.size;
+                const Edge* it = lower_bound(b, e, tok,
+                        [](const Edge& x, uint32_t t) -> bool {
+                                return x.token < t;
+                });
+                if (it == e || it->token != tok)
+                        return nullptr;
+                return it;
+        }
+
+        void copyNode(Model& to, uint32_t node, vector<uint32_t>& path) const
+        {
+                const Range& r = nodes_[node];
+                if (path.size() >= size_t(order()))
+                        return;
+
+                for (const Edge* x = edges_ + r.first;
+                                x != edges_ + r.first + r.size; ++x) {
+                        to.add(path.data(), path.size(), ids_[x->token],
+                                x->weight, x->flags);
+
+                        if (x->child != NPOS) {
+                                path.push_back(ids_[x->token]);
+                                copyNode(to, x->child, path);
+                                path.pop_back();
+                        }
+                }
+        }
+
+        static uint64_t align(uint64_t x) { return (x + 7) & ~uint64_t(7); }
+
+        static void pad(ostream& os, uint64_t n)
+        {
+                const char zeros[8] = {};
+                os.write(zeros, n);
+        }
+
+        static void markTokens(const Model& m, vector<uint32_t>& path,
+                vector<uint32_t>& local)
+        {
+                const Edge* b = nullptr;
+                const Edge* e = nullptr;
+                if (path.size() >= size_t(m.order())
+                || !m.successors(path.data(), path.size(), b, e))
+                        return;
+
+                for (const Edge* x = b; x != e; ++x) {
+                        if (x->token >= local.size())
+                                local.resize(x->token + 1, NPOS);
+                        local[x->token] = 0;
+                        path.push_back(x->token);
+                        markTokens(m, path, local);
+                        path.pop_back();
+                }
+        }
+
+        // Node of the successors of path, its children come after it.
+        static uint32_t freezeNode(const Model& m, vector<uint32_t>& path,
+                const vector<uint32_t>& local, vector<Range>& nodes,
+                vector<Edge>& edges, vector<uint64_t>& cumulative)
+        {
+                const Edge* b = nullptr;
+                const Edge* e = nullptr;
+                bool found = path.size() < size_t(m.order())
+                        && m.successors(path.data(), path.size(), b, e);
+                if (!found && !path.empty()) // The root is always there.
+                        return NPOS;
+
+                uint32_t node = nodes.size();
+                uint32_t first = edges.size();
+                nodes.push_back(Range{first, uint32_t(e - b)});
+
+                uint64_t sum = 0;
+                for (const Edge* x = b; x != e; ++x) {
+                        sum += x->weight;
+                        edges.push_back(Edge{local[x->token], x->weight,
+                                x->flags, NPOS});
+                        cumulative.push_back(sum);
+                }
+
+                for (uint32_t i = 0; i < e - b; ++i) {
+                        path.push_back(b[i].token);
+                        uint32_t child = freezeNode(m, path, local, nodes,
+                                edges, cumulative);
+                        path.pop_back();
+                        edges[first + i].child = child;
+                }
+                return node;
+        }
+};
+
+#endif // FROZENMODEL_H
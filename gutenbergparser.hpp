@@ -24,6 +24,9 @@
 #include <string>
 #include <sstream>
 
+#include "ahocorasick.hpp"
+#include "scan.hpp"
+
 using namespace std;
 
 enum States {FIRSTNOTICE, BADLINE, END};
@@ -31,168 +34,125 @@ enum States {FIRSTNOTICE, BADLINE, END};
 struct GutenbergParser {
         GutenbergParser() {}
 
-        bool isAllUpper(const string& s)
+        // Every marker the cleanup looks for, bit i of a match is pattern i.
+        static const AhoCorasick& markers()
         {
-                int up = 0;
-                for (const auto& x : s) {
-                        if (!isalpha(x)) {}
-                        else if (isupper(x)) {
-                                up++;
-                        }
-                }
-                if ((float(up) / s.size()) > 0.4f)
-                        return true;
-
-                return false;
+                static const AhoCorasick ret({
+                        "The Project Gutenberg EBook of",
+                        "Produced by",
+                        "Proofreading Team",
+                        "produced from images generously made available by",
+                        "Internet Archive",
+                        "THE END",
+                        "*** END OF THIS PROJECT GUTENBERG",
+                        "CHAPTER", "---", "    *", "=>", "{", "[", "]",
+                        "*** START OF THIS PROJECT GUTENBERG EBOOK"
+                });
+                return ret;
         }
 
-        bool fiveSpaces(const string& s)
+        static const uint64_t NOTICE_MARKERS = 1 << 0;
+        static const uint64_t CREDIT_MARKERS = 0xF << 1;
+        static const uint64_t END_MARKERS = 0x3 << 5;
+        static const uint64_t BAD_MARKERS = 0x7F << 7;
+        static const uint64_t START_MARKER = 1 << 14;
+
+        /*
+         * State of a line in one pass, no allocation. The markers come from
+         * the automaton, capitals, "     1" style numbering and the first
+         * parenthesis from the same loop. Checks keep the priority the
+         * original chain of finds had.
+         */
+        int classify(const string& s)
         {
-                if (s.size() < 5)
-                        return false;
-
-                bool spaces = true;
-                for (int i = 0; i < 5; ++i) {
-                        if (s[i] != ' ')
-                                spaces = false;
+                const AhoCorasick& ac = markers();
+                uint64_t found = 0;
+                uint32_t state = 0;
+                size_t up = 0;
+                size_t spaces = 0;
+                bool numbered = false; // Five spaces then a digit.
+                size_t paren = string::npos;
+
+                for (size_t i = 0; i < s.size(); ++i) {
+                        char c = s[i];
+                        state = ac.step(state, c);
+                        found |= ac.matches(state);
+
+                        if (isUpperByte(c))
+                                ++up;
+                        if (isdigit((unsigned char)c) && spaces >= 5)
+                                numbered = true;
+                        spaces = c == ' ' ? spaces + 1 : 0;
+                        if (c == '(' && paren == string::npos)
+                                paren = i;
                 }
-                return spaces;
-        }
 
-        bool fiveSpacesAndNum(const string& s)
-        {
-                bool spaces = false;
-                for (int i = 0; i < s.size(); ++i) {
-                        if (s[i] == ' ' && s[i+1] == ' ' &&
-                        s[i+2] == ' ' && s[i+3] == ' ' &&
-                        s[i+4] == ' ') {
-                                if (isdigit(s[i+5])) {
-                                        spaces = true;
-                                        break;
-                                }
-                        }
-                }
-                return spaces;
+                if (found & NOTICE_MARKERS)
+                        return FIRSTNOTICE;
+                if (found & CREDIT_MARKERS)
+                        return BADLINE;
+                if (found & END_MARKERS)
+                        return END;
+                if (found & BAD_MARKERS)
+                        return BADLINE;
+
+                if (s.compare(0, 5, "Page ") == 0 || s.compare(0, 3, "***") == 0)
+                        return BADLINE;
+
+                // Mostly capitals, a title.
+                if (float(up) / s.size() > 0.4f)
+                        return BADLINE;
+
+                if (s.compare(0, 5, "     ") == 0 || numbered)
+                        return BADLINE;
+
+                // Foot notes, "12. bla bla" or "(a)".
+                size_t digits = 0;
+                while (digits < s.size() && isdigit((unsigned char)s[digits]))
+                        ++digits;
+                if (digits > 0 && digits < s.size() && s[digits] == '.')
+                        return BADLINE;
+                if (paren != string::npos && s.size() >= paren + 3
+                                && (s[paren + 2] == ')' || s[paren + 3] == ')'))
+                        return BADLINE;
+
+                if (s.empty() || s == "\t" || s == "\r\n" || s == "\r"
+                                || s == "\n")
+                        return BADLINE;
+
+                return 4200;
         }
 
-        bool footNote(const string& s)
+        // Skip lines until the next book starts.
+        void skipToStart(istream& is, string& userText)
         {
-                bool note = false;
-
-                if (isdigit(s[0])) { // 12. bla bla
-                        for (int i = 0; i < s.size(); ++i) {
-                                if (!isdigit(s[i]) && s[i] == '.') {
-                                        return true;
-                                } else if (!isdigit(s[i])) {
-                                        break;
-                                }
+                while (getline(is, userText)) {
+                        if (markers().find(userText.data(), userText.size())
+                                        & START_MARKER) {
+                                currentState_ = 4200; // Default
+                                break;
                         }
                 }
-
-                int pos = s.find("(");
-                if (pos != string::npos) {
-                        if (s.size() < pos + 3) {
-                        } else if (s[pos+2] == ')' || s[pos+3] == ')')
-                                return true;
-                }
-
-                return note;
-
         }
 
-        friend istream& operator>>(istream& is, GutenbergParser& gp) {
+        // Calls emit(line) for every line of text kept, already cleaned.
+        template <class F>
+        void parse(istream& is, F emit)
+        {
                 string userText;
 
                 while(getline(is, userText)) {
-                        // Letiral text
-                        if (userText.find("The Project Gutenberg EBook of") != string::npos)
-                                gp.currentState_ = FIRSTNOTICE;
-
-                        else if (userText.find("Produced by") != string::npos)
-                                gp.currentState_ = BADLINE;
-
-                        else if (userText.find("Proofreading Team") != string::npos)
-                                gp.currentState_ = BADLINE;
-
-                        else if (userText.find("produced from images generously made available by") != string::npos)
-                                gp.currentState_ = BADLINE;
-
-                        else if (userText.find("Internet Archive") != string::npos)
-                                gp.currentState_ = BADLINE;
-
-                        else if (userText.find("THE END") != string::npos)
-                                gp.currentState_ = END;
+                        currentState_ = classify(userText);
 
-                        else if (userText.find("*** END OF THIS PROJECT GUTENBERG") != string::npos)
-                                gp.currentState_ = END;
-
-                        else if (userText.find("CHAPTER") != string::npos)
-                                gp.currentState_ = BADLINE;
-
-                        else if (userText.find("---") != string::npos)
-                                gp.currentState_ = BADLINE;
-
-                        else if (userText.find("    *") != string::npos)
-                                gp.currentState_ = BADLINE;
-
-                        else if (userText.find("=>") != string::npos)
-                                gp.currentState_ = BADLINE;
-
-                        else if (userText.find("{") != string::npos)
-                                gp.currentState_ = BADLINE;
-
-                        else if (userText.find("[") != string::npos)
-                                gp.currentState_ = BADLINE;
-
-                        else if (userText.find("]") != string::npos)
-                                gp.currentState_ = BADLINE;
-
-                        else if (userText.substr(0, 5) == "Page ")
-                                gp.currentState_ = BADLINE;
-
-                        else if (userText.substr(0, 3) == "***")
-                                gp.currentState_ = BADLINE;
-
-                        // Patterns
-                        else if (gp.isAllUpper(userText))
-                                gp.currentState_ = BADLINE;
-
-                        else if (gp.fiveSpaces(userText))
-                                gp.currentState_ = BADLINE;
-
-                        else if (gp.fiveSpacesAndNum(userText))
-                                gp.currentState_ = BADLINE;
-
-                        else if (gp.footNote(userText))
-                                gp.currentState_ = BADLINE;
-
-                        else if (userText.empty() || userText == "\t"
-                                || userText == "\r\n" || userText == "\r"
-                                || userText == "\n")
-                                gp.currentState_ = BADLINE;
-
-                        else
-                                gp.currentState_ = 4200;
-
-                        switch(gp.currentState_) {
+                        switch(currentState_) {
                                 case FIRSTNOTICE:
-                                        while(getline(is, userText)) {
-                                                if (userText.find("*** START OF THIS PROJECT GUTENBERG EBOOK") != string::npos) {
-                                                        gp.currentState_ = 4200; // Default
-                                                        break;
-                                                }
-                                        }
+                                        skipToStart(is, userText);
                                 break;
                                 case BADLINE:
 
                                 break;
                                 case END:
-                                        while(getline(is, userText)) {
-                                                if (userText.find("*** START OF THIS PROJECT GUTENBERG EBOOK") != string::npos) {
-                                                        gp.currentState_ = 4200; // Default
-                                                        break;
-                                                }
-                                        }
+                                        skipToStart(is, userText);
                                 break;
                                 default:
                                         // Cleanup
@@ -203,11 +163,16 @@ struct GutenbergParser {
                                         }
                                         userText.erase(remove(userText.begin(), userText.end(), '|'), userText.end());
                                         userText.erase(remove(userText.begin(), userText.end(), '_'), userText.end());
-                                        gp.ss << userText << " ";
+                                        emit(userText);
                                 break;
                         }
                 }
+        }
 
+        friend istream& operator>>(istream& is, GutenbergParser& gp) {
+                gp.parse(is, [&gp](const string& line) {
+                        gp.ss << line << " ";
+                });
                 return gp.ss;
         }
 
@@ -0,0 +1,425 @@
+/*
+ *  Copyright (C) 2014 Philippe Groarke.
+ *  Author: Philippe Groarke <philippe.groarke@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+#ifndef HASHMODEL_H
+#define HASHMODEL_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include "model.hpp"
+#include "word.hpp"
+
+using namespace std;
+
+/*
+ * Every (context, next token) pair is one 64 bit key, the id of the context
+ * in the high half and the token id in the low half, living in a single
+ * open addressing table with the count stored inline. Counting a window is
+ * a few linear probes in one array. Node 0 is the empty context, any other
+ * context is known by the id of its last pair.
+ *
+ * The pairs of a context are threaded in a list by id. Listing and sampling
+ * go through a sorted copy of those lists in cache_. Contexts whose counts
+ * changed are all rebuilt on the next read, so pointers handed out stay
+ * valid until the model is trained again.
+ */
+struct HashModel : public Model {
+        struct Slot {
+                uint64_t key;
+                uint32_t weight;
+                uint32_t flags;
+                uint32_t id; // NPOS if empty.
+        };
+
+        HashModel(int order) :
+                order_(order),
+                slots_(1024, Slot{0, 0, 0, NPOS})
+        {
+                newNode(NPOS);
+        }
+
+        int order() const { return order_; }
+
+        void addChain(const vector<const Word*>& window)
+        {
+                uint32_t node = 0;
+                for (size_t i = 0; i < window.size(); ++i) {
+                        node = increment(node, window[i]->id_, 1,
+                                window[i]->characteristics_);
+                }
+        }
+
+        void add(const uint32_t* context, size_t n, uint32_t token,
+                uint32_t weight, uint32_t flags)
+        {
+                uint32_t node = 0;
+                for (size_t i = 0; i < n; ++i)
+                        node = increment(node, context[i], 0, 0);
+                increment(node, token, weight, flags);
+        }
+
+        void remove(const uint32_t* context, size_t n, uint32_t token)
+        {
+                uint32_t node = find(context, n);
+                if (node == NPOS)
+                        return;
+
+                for (uint32_t* link = &firstChild_[node]; *link != NPOS;
+                                link = &nextSibling_[*link]) {
+                        uint32_t c = *link;
+                        if (tokens_[c] != token)
+                                continue;
+
+                        *link = nextSibling_[c];
+                        erase(findSlot(makeKey(node, token)));
+                        freeSubtree(c);
+                        markDirty(node);
+                        return;
+                }
+        }
+
+        bool successors(const uint32_t* context, size_t n,
+                const Edge*& begin, const Edge*& end) const
+        {
+                refresh();
+                uint32_t node = find(context, n);
+                if (node == NPOS || firstChild_[node] == NPOS)
+                        return false;
+
+                begin = cache_.begin(node);
+                end = cache_.end(node);
+                return true;
+        }
+
+        const Edge* sample(const uint32_t* context, size_t n, mt19937& gen)
+        {
+                refresh();
+                uint32_t node = find(context, n);
+                if (node == NPOS || firstChild_[node] == NPOS)
+                        return nullptr;
+
+                uint32_t e = cache_.sample(node, gen);
+                return e == NPOS ? nullptr : &cache_.edge(e);
+        }
+
+        uint32_t weight(const uint32_t* context, size_t n, uint32_t token) const
+        {
+                uint32_t node = find(context, n);
+                if (node == NPOS)
+                        return 0;
+
+                uint32_t s = findSlot(makeKey(node, token));
+                return s == NPOS ? 0 : slots_[s].weight;
+        }
+
+        size_t numSuccessors(const uint32_t* context, size_t n) const
+        {
+                uint32_t node = find(context, n);
+                if (node == NPOS)
+                        return 0;
+
+                size_t ret = 0;
+                for (uint32_t c = firstChild_[node]; c != NPOS; c = nextSibling_[c])
+                        ++ret;
+                return ret;
+        }
+
+        // Freed ids will be used again, they don't count.
+        size_t memory() const
+        {
+                return slots_.capacity() * sizeof(Slot)
+                        + (tokens_.capacity() + firstChild_.capacity()
+                        + nextSibling_.capacity() + epochs_.capacity()
+                        - 4 * freeIds_.size()
+                        + freeIds_.capacity() + stack_.capacity()
+                        + dirty_.capacity())
+                        * sizeof(uint32_t)
+                        + isDirty_.capacity() / 8
+                        + cache_.memory();
+        }
+
+        unique_ptr<Model> clone() const
+        {
+                return unique_ptr<Model>(new HashModel(*this));
+        }
+
+        void reserve(size_t numEdges)
+        {
+                size_t size = slots_.size();
+                while (size < numEdges * 2)
+                        size *= 2;
+                if (size > slots_.size())
+                        rehash(size);
+
+                tokens_.reserve(numEdges);
+                firstChild_.reserve(numEdges);
+                nextSibling_.reserve(numEdges);
+                epochs_.reserve(numEdges);
+        }
+
+        void prepare()
+        {
+                refresh();
+                cache_.prepare();
+        }
+
+        // Walks contexts by id, a forgotten pair takes its whole subtree along.
+        void decaySlice(float factor, uint32_t threshold, size_t work)
+        {
+                work = min(work, tokens_.size());
+                for (; work > 0; --work) {
+                        if (cursor_ >= tokens_.size())
+                                cursor_ = 0;
+
+                        decayNode(cursor_++, factor, threshold);
+                }
+        }
+
+        static uint64_t makeKey(uint32_t node, uint32_t token)
+        {
+                return (uint64_t(node) << 32) | token;
+        }
+
+        int order_;
+        vector<Slot> slots_; // Power of 2.
+
+        // By id.
+        vector<uint32_t> tokens_;
+        vector<uint32_t> firstChild_;
+        vector<uint32_t> nextSibling_;
+        vector<uint32_t> epochs_; // Last decay applied to the successors.
+        vector<uint32_t> freeIds_;
+        uint32_t cursor_ = 0; // Next context to decay.
+        mutable vector<uint32_t> dirty_; // Contexts to rebuild in cache_.
+        mutable vector<bool> isDirty_;
+        mutable EdgeStore cache_;
+        mutable vector<Edge> scratch_;
+
+private:
+        static size_t hash(uint64_t key)
+        {
+                key ^= key >> 33;
+                key *= 0xFF51AFD7ED558CCDULL;
+                key ^= key >> 33;
+                return key;
+        }
+
+        uint32_t newNode(uint32_t token)
+        {
+                if (!freeIds_.empty()) {
+                        uint32_t id = freeIds_.back();
+                        freeIds_.pop_back();
+                        tokens_[id] = token;
+                        epochs_[id] = epoch_;
+                        return id;
+                }
+
+                tokens_.push_back(token);
+                firstChild_.push_back(NPOS);
+                nextSibling_.push_back(NPOS);
+                epochs_.push_back(epoch_);
+                isDirty_.push_back(false);
+                return tokens_.size() - 1;
+        }
+
+        // Remove every pair under id and give the ids back.
+        void freeSubtree(uint32_t id)
+        {
+                stack_.push_back(id);
+                while (!stack_.empty()) {
+                        uint32_t node = stack_.back();
+                        stack_.pop_back();
+                        for (uint32_t c = firstChild_[node]; c != NPOS;
+                                        c = nextSibling_[c]) {
+                                erase(findSlot(makeKey(node, tokens_[c])));
+                                stack_.push_back(c);
+                        }
+
+                        if (node < cache_.nodes_.size())
+                                cache_.clearNode(node);
+                        tokens_[node] = NPOS;
+                        firstChild_[node] = NPOS;
+                        nextSibling_[node] = NPOS;
+                        freeIds_.push_back(node);
+                }
+        }
+
+        void markDirty(uint32_t node)
+        {
+                if (!isDirty_[node]) {
+                        isDirty_[node] = true;
+                        dirty_.push_back(node);
+                }
+        }
+
+        // Slot of the pair, or NPOS.
+        uint32_t findSlot(uint64_t key) const
+        {
+                size_t mask = slots_.size() - 1;
+                for (size_t i = hash(key) & mask;; i = (i + 1) & mask) {
+                        if (slots_[i].id == NPOS)
+                                return NPOS;
+                        if (slots_[i].key == key)
+                                return i;
+                }
+        }
+
+        // Bring the pairs of a context up to epoch_.
+        void decayNode(uint32_t node, float factor, uint32_t threshold)
+        {
+                if (epochs_[node] >= epoch_)
+                        return;
+
+                double keep = pow(double(factor), double(epoch_ - epochs_[node]));
+                epochs_[node] = epoch_;
+                if (firstChild_[node] == NPOS)
+                        return;
+
+                uint32_t* link = &firstChild_[node];
+                while (*link != NPOS) {
+                        uint32_t c = *link;
+                        uint32_t s = findSlot(makeKey(node, tokens_[c]));
+                        slots_[s].weight = decayWeight(slots_[s].weight, keep,
+                                decaySeed(slots_[s].key, epoch_));
+                        if (slots_[s].weight >= threshold) {
+                                link = &nextSibling_[c];
+                                continue;
+                        }
+
+                        *link = nextSibling_[c];
+                        erase(s);
+                        freeSubtree(c);
+                }
+                markDirty(node);
+        }
+
+        // Add weight to the pair, returns the id of the context it makes.
+        uint32_t increment(uint32_t node, uint32_t token, uint32_t weight,
+                uint32_t flags)
+        {
+                decayNode(node, decayFactor_, decayThreshold_);
+                if ((tokens_.size() + 1) * 2 > slots_.size())
+                        rehash(slots_.size() * 2);
+
+                uint64_t key = makeKey(node, token);
+                size_t mask = slots_.size() - 1;
+                size_t i = hash(key) & mask;
+                while (slots_[i].id != NPOS && slots_[i].key != key)
+                        i = (i + 1) & mask;
+
+                markDirty(node);
+
+                Slot& s = slots_[i];
+                if (s.id != NPOS) {
+                        s.weight += weight;
+                        s.flags |= flags;
+                        return s.id;
+                }
+
+                uint32_t id = newNode(token);
+                nextSibling_[id] = firstChild_[node];
+                firstChild_[node] = id;
+                s = Slot{key, weight, flags, id};
+                return id;
+        }
+
+        uint32_t find(const uint32_t* context, size_t n) const
+        {
+                uint32_t node = 0;
+                for (size_t i = 0; i < n; ++i) {
+                        uint32_t s = findSlot(makeKey(node, context[i]));
+                        if (s == NPOS)
+                                return NPOS;
+                        node = slots_[s].id;
+                }
+                return node;
+        }
+
+        void refresh() const
+        {
+                if (dirty_.empty())
+                        return;
+
+                while (cache_.nodes_.size() < tokens_.size())
+                        cache_.newNode();
+
+                for (auto node : dirty_) {
+                        scratch_.clear();
+                        for (uint32_t c = firstChild_[node]; c != NPOS;
+                                        c = nextSibling_[c]) {
+                                const Slot& s = slots_[findSlot(
+                                        makeKey(node, tokens_[c]))];
+                                scratch_.push_back(
+                                        Edge{tokens_[c], s.weight, s.flags, c});
+                        }
+                        sort(scratch_.begin(), scratch_.end(), [](const Edge& a,
+                                const Edge& b) -> bool {
+                                return a.token < b.token;
+                        });
+
+                        cache_.assign(node, scratch_.data(),
+                                scratch_.data() + scratch_.size());
+                }
+
+                for (auto node : dirty_)
+                        isDirty_[node] = false;
+                dirty_.clear();
+        }
+
+        // Backward shift deletion, keeps probe chains whole without tombstones.
+        void erase(size_t i)
+        {
+                size_t mask = slots_.size() - 1;
+                for (size_t j = i;;) {
+                        slots_[i].id = NPOS;
+                        size_t k = 0;
+                        do {
+                                j = (j + 1) & mask;
+                                if (slots_[j].id == NPOS)
+                                        return;
+                                k = hash(slots_[j].key) & mask;
+                        } while (i <= j ? (i < k && k <= j) : (i < k || k <= j));
+                        slots_[i] = slots_[j];
+                        i = j;
+                }
+        }
+
+        vector<uint32_t> stack_;
+
+        void rehash(size_t size)
+        {
+                vector<Slot> temp(size, Slot{0, 0, 0, NPOS});
+                size_t mask = size - 1;
+                for (auto& x : slots_) {
+                        if (x.id == NPOS)
+                                continue;
+                        size_t i = hash(x.key) & mask;
+                        while (temp[i].id != NPOS)
+                                i = (i + 1) & mask;
+                        temp[i] = x;
+                }
+                slots_.swap(temp);
+        }
+};
+
+#endif // HASHMODEL_H
@@ -47,7 +47,7 @@ public:
         void start();
         void say(const string& msg);
         void say(const vector<string>& msg);
-        unique_ptr<vector<unique_ptr<Word> > > getCachedSentences();
+        unique_ptr<vector<Word> > getCachedSentences();
 
         atomic<int> socket_; //socket descriptor
         atomic_bool stop = {false};
@@ -73,7 +73,7 @@ private:
         string formatPrivMsg(const string& command, const string& channel,
                 const string& str);
         void sendPong(const string& msg);
-        void doUsersCharacteristics(unique_ptr<vector<unique_ptr<Word> > >& vec);
+        void doUsersCharacteristics(unique_ptr<vector<Word> >& vec);
         void doUsersPart();
         void joinAllChannels();
 
@@ -142,9 +142,9 @@ void Irc::say(const vector<string>& msg)
 
 }
 
-unique_ptr<vector<unique_ptr<Word> > > Irc::getCachedSentences()
+unique_ptr<vector<Word> > Irc::getCachedSentences()
 {
-        unique_ptr<vector<unique_ptr<Word> > > ret(new vector<unique_ptr<Word> >);
+        unique_ptr<vector<Word> > ret(new vector<Word>);
 
         lock_guard<mutex> lk(sentences_mutex);
 
@@ -157,20 +157,17 @@ unique_ptr<vector<unique_ptr<Word> > > Irc::getCachedSentences()
                 stringstream ss(x);
                 string word;
 
-                vector<unique_ptr<Word> > tempSentence;
+                size_t first = ret->size();
                 while(ss >> word) {
-                        tempSentence.push_back(unique_ptr<Word>(new Word(word)));
+                        ret->push_back(Word(word));
                 }
 
-                if (tempSentence.size() <= 0)
+                if (ret->size() <= first)
                         continue;
 
                 // Since IRC doesnt necessarily have caps or . , add characters here.
-                tempSentence.front()->characteristics_.insert(CHARACTER_BEGIN);
-                tempSentence.back()->characteristics_.insert(CHARACTER_ENDL);
-
-                ret->insert(ret->end(), make_move_iterator(tempSentence.begin()),
-                        make_move_iterator(tempSentence.end()));
+                (*ret)[first].characteristics_ |= CHARACTER_BEGIN;
+                ret->back().characteristics_ |= CHARACTER_ENDL;
         }
 
         // Find names! And groove tonight, share the spice of life!
@@ -496,7 +493,7 @@ void Irc::sendPong(const string& msg)
         }
 }
 
-void Irc::doUsersCharacteristics(unique_ptr<vector<unique_ptr<Word> > >& vec)
+void Irc::doUsersCharacteristics(unique_ptr<vector<Word> >& vec)
 {
         lock_guard<mutex> lk(users_mutex);
         // Each word
@@ -504,7 +501,7 @@ void Irc::doUsersCharacteristics(unique_ptr<vector<unique_ptr<Word> > >& vec)
                 // Find if word is a username, needs lowercase.
                 for (const auto& name : users_) {
                         string tempName = name;
-                        string tempWord = word->word_;
+                        string tempWord = word.str();
 
                         if (tempWord[0] == '@') // remove @
                                 tempWord.erase(0, 1);
@@ -521,7 +518,7 @@ void Irc::doUsersCharacteristics(unique_ptr<vector<unique_ptr<Word> > >& vec)
 
                         if (tempWord.find(tempName) != string::npos) {
                                 cout << endl << "Found name match! " << tempWord << " = " << tempName << endl;
-                                word->characteristics_.insert(CHARACTER_NAME);
+                                word.characteristics_ |= CHARACTER_NAME;
                                 break;
                         }
                 }
@@ -0,0 +1,268 @@
+/*
+ *  Copyright (C) 2014 Philippe Groarke.
+ *  Author: Philippe Groarke <philippe.groarke@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "mappedfile.hpp"
+#include "model.hpp"
+#include "varint.hpp"
+#include "word.hpp"
+
+using namespace std;
+
+const char JOURNAL_MAGIC[] = "DSMJ";
+const uint32_t JOURNAL_VERSION = 1;
+
+// Journal records, each a byte followed by varints.
+const char JOURNAL_SESSION = 'S'; // Token numbers start over.
+const char JOURNAL_TOKEN = 'T'; // Length and bytes, the next token number.
+const char JOURNAL_CHAIN = 'C'; // Length, then token number and flags.
+const char JOURNAL_DECAY = 'D'; // Factor bits, threshold and work.
+
+/*
+ * Everything learned since the last full save, appended as it happens.
+ * Tokens are written out once per session and numbered from there, a
+ * chain costs a few bytes. Database::save starts a new journal, loadFile
+ * replays what is left on top of the snapshot.
+ */
+struct Journal {
+        ~Journal() { close(); }
+
+        // Appends to f. A record cut short by a crash is dropped first.
+        bool open(const string& f)
+        {
+                close();
+                uint64_t valid = replay(f, nullptr);
+                if (valid > 0 && ::truncate(f.c_str(), valid) != 0)
+                        return false;
+
+                // Anything that isn't a journal is started over.
+                out_.open(f, ios::out | ios::binary
+                        | (valid > 0 ? ios::app : ios::trunc));
+                if (!out_.is_open())
+                        return false;
+
+                if (valid == 0) {
+                        out_.write(JOURNAL_MAGIC, 4);
+                        writeVarint(out_.rdbuf(), JOURNAL_VERSION);
+                }
+                out_.put(JOURNAL_SESSION);
+                name_ = f;
+                return true;
+        }
+
+        void close()
+        {
+                if (out_.is_open())
+                        out_.close();
+                ids_.clear();
+                numTokens_ = 0;
+        }
+
+        bool is_open() const { return out_.is_open(); }
+
+        void addChain(const vector<const Word*>& window)
+        {
+                streambuf* sb = out_.rdbuf();
+                for (auto w : window)
+                        number(w->id_);
+
+                sb->sputc(JOURNAL_CHAIN);
+                writeVarint(sb, window.size());
+                for (auto w : window) {
+                        writeVarint(sb, ids_[w->id_]);
+                        writeVarint(sb, w->characteristics_);
+                }
+        }
+
+        void decay(float factor, uint32_t threshold, size_t work)
+        {
+                uint32_t bits = 0;
+                memcpy(&bits, &factor, sizeof(bits));
+
+                streambuf* sb = out_.rdbuf();
+                sb->sputc(JOURNAL_DECAY);
+                writeVarint(sb, bits);
+                writeVarint(sb, threshold);
+                writeVarint(sb, work);
+        }
+
+        void flush() { out_.flush(); }
+
+        // Bytes on disk, as of the last flush.
+        uint64_t size() const { return fileSize(name_); }
+
+        /*
+         * Learn every whole record of f into m, or only check them if m is
+         * nullptr. Returns how many bytes were whole, 0 if f isn't a journal.
+         */
+        static uint64_t replay(const string& f, Model* m)
+        {
+                MappedFile file(f);
+                MemoryBuffer buffer;
+                buffer.set(file.data(), file.size());
+                streambuf* sb = &buffer;
+                if (!file.is_open() || !readHeader(sb))
+                        return 0;
+
+                uint64_t valid = buffer.position();
+                vector<uint32_t> ids;
+                vector<Word> words;
+                vector<const Word*> window;
+                string w;
+                for (int c = sb->sbumpc(); c != char_traits<char>::eof();
+                                c = sb->sbumpc()) {
+                        if (c == JOURNAL_SESSION) {
+                                ids.clear();
+                        } else if (c == JOURNAL_TOKEN) {
+                                uint64_t n = 0;
+                                if (!readVarint(sb, n) || n > MAX_TOKEN_SIZE)
+                                        break;
+                                w.resize(n);
+                                if (sb->sgetn(&w[0], n) != streamsize(n))
+                                        break;
+                                ids.push_back(symbols().intern(w));
+                        } else if (c == JOURNAL_CHAIN) {
+                                if (!readChain(sb, ids, words))
+                                        break;
+                                if (m != nullptr) {
+                                        window.clear();
+                                        for (auto& x : words)
+                                                window.push_back(&x);
+                                        m->addChain(window);
+                                }
+                        } else if (c == JOURNAL_DECAY) {
+                                uint64_t bits = 0;
+                                uint64_t threshold = 0;
+                                uint64_t work = 0;
+                                if (!readVarint(sb, bits)
+                                || !readVarint(sb, threshold)
+                                || !readVarint(sb, work))
+                                        break;
+
+                                float factor = 0;
+                                uint32_t b = bits;
+                                memcpy(&factor, &b, sizeof(factor));
+                                if (m != nullptr)
+                                        m->decay(factor, threshold, work);
+                        } else {
+                                break;
+                        }
+                        valid = buffer.position();
+                }
+
+                if (m != nullptr)
+                        m->prepare();
+                return valid;
+        }
+
+        /*
+         * Move the whole records of from to the end of to. A save that
+         * didn't finish left to behind, what it holds can't be lost.
+         */
+        static bool append(const string& from, const string& to)
+        {
+                uint64_t valid = replay(to, nullptr);
+                if (valid == 0)
+                        return rename(from.c_str(), to.c_str()) == 0;
+                if (::truncate(to.c_str(), valid) != 0)
+                        return false;
+
+                // Records start after the header, with a session.
+                uint64_t end = replay(from, nullptr);
+                MappedFile file(from);
+                MemoryBuffer buffer;
+                buffer.set(file.data(), file.size());
+                if (end > 0 && readHeader(&buffer)) {
+                        uint64_t start = buffer.position();
+                        ofstream out(to, ios::out | ios::binary | ios::app);
+                        out.write(file.data() + start, end - start);
+                        out.close();
+                        if (!out)
+                                return false;
+                }
+                return remove(from.c_str()) == 0;
+        }
+
+        // True if f holds anything to replay.
+        static bool exists(const string& f) { return fileSize(f) > 6; }
+
+        ofstream out_;
+        string name_;
+        vector<uint32_t> ids_; // Symbol id to token number, NPOS if none.
+        uint32_t numTokens_ = 0;
+
+private:
+        // Skip the magic and version, false if sb isn't a journal.
+        static bool readHeader(streambuf* sb)
+        {
+                char magic[4];
+                uint64_t version = 0;
+                return sb->sgetn(magic, 4) == 4
+                        && memcmp(magic, JOURNAL_MAGIC, 4) == 0
+                        && readVarint(sb, version) && version <= JOURNAL_VERSION;
+        }
+
+        // Write the token out the first time this session sees it.
+        void number(uint32_t id)
+        {
+                if (id >= ids_.size())
+                        ids_.resize(symbols().size(), NPOS);
+                if (ids_[id] != NPOS)
+                        return;
+
+                const string& w = symbols().str(id);
+                streambuf* sb = out_.rdbuf();
+                sb->sputc(JOURNAL_TOKEN);
+                writeVarint(sb, w.size());
+                sb->sputn(w.data(), w.size());
+                ids_[id] = numTokens_++;
+        }
+
+        static bool readChain(streambuf* sb, const vector<uint32_t>& ids,
+                vector<Word>& words)
+        {
+                uint64_t n = 0;
+                if (!readVarint(sb, n) || n > MAX_MARKOV_LENGTH)
+                        return false;
+
+                words.resize(n);
+                for (auto& x : words) {
+                        uint64_t tok = 0;
+                        uint64_t flags = 0;
+                        if (!readVarint(sb, tok) || !readVarint(sb, flags)
+                        || tok >= ids.size())
+                                return false;
+                        x.id_ = ids[tok];
+                        x.characteristics_ = flags;
+                }
+                return true;
+        }
+};
+
+#endif // JOURNAL_H
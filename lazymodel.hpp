@@ -0,0 +1,302 @@
+/*
+ *  Copyright (C) 2014 Philippe Groarke.
+ *  Author: Philippe Groarke <philippe.groarke@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+#ifndef LAZYMODEL_H
+#define LAZYMODEL_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "compression.hpp"
+#include "mappedfile.hpp"
+#include "model.hpp"
+#include "triemodel.hpp"
+#include "varint.hpp"
+#include "word.hpp"
+
+using namespace std;
+
+// Bytes of decoded contexts kept by default.
+const size_t LAZY_CACHE = size_t(256) << 20;
+
+/*
+ * A binary database read only as far as it is used. Opening reads the
+ * tokens and the index of first words, the context of a first word is
+ * decoded from the mapping the first time it is followed, inflating only
+ * its block. The least recently used contexts are dropped once they hold
+ * more than the budget.
+ *
+ * Reads load contexts, so unlike the other models it can't be shared
+ * between threads. Edges it returns are good until the next call.
+ */
+struct LazyModel : public Model {
+        struct Slot {
+                uint32_t block; // NPOS if the context isn't compressed.
+                uint64_t offset; // In the block or else in the file.
+                uint64_t size;
+                unique_ptr<TrieModel> context; // Null until used.
+                list<uint32_t>::iterator lru;
+        };
+
+        LazyModel(size_t budget = LAZY_CACHE) : budget_(budget) {}
+
+        // False if f isn't a binary database with an index.
+        bool open(const string& f)
+        {
+                if (!file_.open(f, MADV_RANDOM))
+                        return false;
+
+                MemoryBuffer buffer;
+                buffer.set(file_.data(), file_.size());
+                streambuf* sb = &buffer;
+
+                char magic[4];
+                uint64_t version = 0;
+                uint64_t length = 0;
+                uint64_t numEdges = 0;
+                uint64_t numRoots = 0;
+                if (sb->sgetn(magic, 4) != 4 || memcmp(magic, DSMC_MAGIC, 4) != 0
+                || !readVarint(sb, version) || version < 2
+                || version > DSMC_VERSION || !readVarint(sb, length)
+                || length == 0 || length > MAX_MARKOV_LENGTH)
+                        return false;
+                order_ = length;
+
+                string tokens;
+                MemoryBuffer table;
+                if (version >= 3) {
+                        if (!readBlock(sb, tokens))
+                                return false;
+                        table.set(tokens.data(), tokens.size());
+                }
+                if (!readTokens(version >= 3 ? &table : sb, ids_)
+                || !readVarint(sb, numEdges) || !readVarint(sb, numRoots))
+                        return false;
+
+                // The index, contexts follow it in the same order.
+                vector<Edge> roots;
+                for (uint64_t i = 0; i < numRoots; ++i) {
+                        uint64_t tok = 0;
+                        uint64_t weight = 0;
+                        uint64_t flags = 0;
+                        uint64_t size = 0;
+                        if (!readVarint(sb, tok) || !readVarint(sb, weight)
+                        || !readVarint(sb, flags) || !readVarint(sb, size)
+                        || tok >= ids_.size())
+                                return false;
+
+                        roots.push_back(Edge{ids_[tok], uint32_t(weight),
+                                uint32_t(flags), uint32_t(i)});
+                        slots_.push_back(Slot{NPOS, 0, size, nullptr, lru_.end()});
+                }
+
+                vector<Block> blocks;
+                if (version >= 3 && !readBlockIndex(sb, blocks, numRoots))
+                        return false;
+
+                // Where each context starts, in its block or in the file.
+                uint64_t offset = buffer.position();
+                if (version < 3) {
+                        for (auto& x : slots_) {
+                                x.offset = offset;
+                                offset += x.size;
+                        }
+                }
+
+                size_t slot = 0;
+                for (auto& b : blocks) {
+                        uint64_t inBlock = 0;
+                        for (uint64_t i = 0; i < b.count; ++i, ++slot) {
+                                slots_[slot].block = blocks_.size();
+                                slots_[slot].offset = inBlock;
+                                inBlock += slots_[slot].size;
+                        }
+                        if (inBlock > b.rawSize)
+                                return false;
+
+                        blocks_.push_back(Extent{offset, b.size, b.rawSize});
+                        offset += b.size;
+                }
+                if (offset > file_.size())
+                        return false;
+
+                // By token like every model, child is the slot.
+                sort(roots.begin(), roots.end(), [](const Edge& a,
+                        const Edge& b) -> bool {
+                        return a.token < b.token;
+                });
+                store_.newNode();
+                store_.assign(0, roots.data(), roots.data() + roots.size());
+                store_.prepare();
+                return true;
+        }
+
+        int order() const { return order_; }
+
+        // Read only, the Database only hands it out when nothing learns.
+        void addChain(const vector<const Word*>& window) {}
+        void add(const uint32_t* context, size_t n, uint32_t token,
+                uint32_t weight, uint32_t flags) {}
+        void remove(const uint32_t* context, size_t n, uint32_t token) {}
+        void decaySlice(float factor, uint32_t threshold, size_t work) {}
+        void prepare() {}
+
+        bool successors(const uint32_t* context, size_t n,
+                const Edge*& begin, const Edge*& end) const
+        {
+                if (n == 0) {
+                        begin = store_.begin(0);
+                        end = store_.end(0);
+                        return true;
+                }
+
+                TrieModel* c = load(context[0]);
+                return c != nullptr && c->successors(context + 1, n - 1,
+                        begin, end);
+        }
+
+        const Edge* sample(const uint32_t* context, size_t n, mt19937& gen)
+        {
+                if (n == 0) {
+                        uint32_t e = store_.sample(0, gen);
+                        return e == NPOS ? nullptr : &store_.edge(e);
+                }
+
+                TrieModel* c = load(context[0]);
+                return c == nullptr ? nullptr : c->sample(context + 1, n - 1, gen);
+        }
+
+        uint32_t weight(const uint32_t* context, size_t n, uint32_t token) const
+        {
+                if (n == 0) {
+                        uint32_t e = store_.findEdge(0, token);
+                        return e == NPOS ? 0 : store_.edge(e).weight;
+                }
+
+                TrieModel* c = load(context[0]);
+                return c == nullptr ? 0 : c->weight(context + 1, n - 1, token);
+        }
+
+        size_t numSuccessors(const uint32_t* context, size_t n) const
+        {
+                if (n == 0)
+                        return store_.nodes_[0].size;
+
+                TrieModel* c = load(context[0]);
+                return c == nullptr ? 0 : c->numSuccessors(context + 1, n - 1);
+        }
+
+        size_t memory() const { return store_.memory() + resident_; }
+
+        // Every context, decoded once more.
+        unique_ptr<Model> clone() const
+        {
+                unique_ptr<Model> ret(new TrieModel(order_));
+                vector<uint32_t> path;
+                for (const Edge* x = store_.begin(0); x != store_.end(0); ++x) {
+                        ret->add(nullptr, 0, x->token, x->weight, x->flags);
+                        path.assign(1, x->token);
+                        decode(x->child, *ret, path);
+                }
+                return ret;
+        }
+
+        // A compressed block in the file.
+        struct Extent {
+                uint64_t offset;
+                uint64_t size;
+                uint64_t rawSize;
+        };
+
+        EdgeStore store_; // The first words, child is their slot.
+        int order_ = 0;
+        MappedFile file_;
+        vector<uint32_t> ids_; // File token to process token.
+        mutable vector<Slot> slots_;
+        mutable list<uint32_t> lru_; // Decoded slots, most recent first.
+        mutable size_t resident_ = 0;
+        size_t budget_;
+        vector<Extent> blocks_;
+        mutable string raw_; // The last block inflated.
+        mutable uint32_t rawBlock_ = NPOS;
+
+private:
+        // The context of a first word, decoded if it isn't already.
+        TrieModel* load(uint32_t tok) const
+        {
+                uint32_t e = store_.findEdge(0, tok);
+                if (e == NPOS || order_ < 2)
+                        return nullptr;
+
+                uint32_t slot = store_.edge(e).child;
+                Slot& s = slots_[slot];
+                if (s.context) {
+                        lru_.splice(lru_.begin(), lru_, s.lru);
+                        return s.context.get();
+                }
+
+                vector<uint32_t> path;
+                s.context.reset(new TrieModel(order_ - 1));
+                decode(slot, *s.context, path);
+                s.context->prepare();
+                resident_ += s.context->memory();
+                lru_.push_front(slot);
+                s.lru = lru_.begin();
+
+                // The slot just loaded stays, even over budget.
+                while (resident_ > budget_ && lru_.size() > 1) {
+                        Slot& old = slots_[lru_.back()];
+                        resident_ -= old.context->memory();
+                        old.context.reset();
+                        lru_.pop_back();
+                }
+                return s.context.get();
+        }
+
+        // What is damaged is left out.
+        void decode(uint32_t slot, Model& to, vector<uint32_t>& path) const
+        {
+                const Slot& s = slots_[slot];
+                const char* data = file_.data();
+                if (s.block != NPOS) {
+                        if (rawBlock_ != s.block) {
+                                const Extent& b = blocks_[s.block];
+                                rawBlock_ = s.block;
+                                if (!inflateBlock(file_.data() + b.offset, b.size,
+                                        b.rawSize, raw_))
+                                        raw_.clear();
+                        }
+                        if (s.offset + s.size > raw_.size())
+                                return;
+                        data = raw_.data();
+                }
+
+                MemoryBuffer buffer;
+                buffer.set(data + s.offset, s.size);
+                to.readContext(&buffer, ids_, path);
+        }
+};
+
+#endif // LAZYMODEL_H
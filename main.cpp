@@ -21,9 +21,18 @@
  * This software builds markov chains of length n.
  */
 
+#include "compression.hpp"
 #include "gutenbergparser.hpp"
+#include "hashmodel.hpp"
 #include "irc.hpp"
 #include "database.hpp"
+#include "filepool.hpp"
+#include "mappedfile.hpp"
+#include "markovmodel.hpp"
+#include "model.hpp"
+#include "paralleltrainer.hpp"
+#include "pipeline.hpp"
+#include "triemodel.hpp"
 #include "reader.hpp"
 #include "voice.hpp"
 #include "word.hpp"
@@ -52,10 +61,18 @@ using namespace std;
 
 string databaseFile = "data.dsmc";
 string inputFilename = "";
+string modelType = "";
 int markovLength = 3;
+int memoryLimit = 0; // MB
+int numThreads = 1;
 int numSentences = 1;
+int maxWords = 20;
 float randomRange = 0.0;
 int sentenceDelay = 120;
+float decayFactor = 1.0; // Weight kept every delay, 1 never forgets.
+int pruneWeight = 1;
+const size_t DECAY_WORK = 1 << 16; // Contexts decayed every delay.
+const int TRAIN_DELAY = 1; // Seconds between learning chat batches.
 bool doSTDINRead, doFileRead, doGutenberg, doSpeak, doIrc, allChannels = false;
 
 atomic_bool quitApp(false); // = false; is WRONG
@@ -79,16 +96,20 @@ void printHelp()
         //Input
         cout << "* Input:" << endl << endl;
         cout << setw(25) << left << "--stdin" << "Learn from input pipe." << endl;
-        cout << setw(25) << left << "--file [filename]" << "Learn from file." << endl;
+        cout << setw(25) << left << "--file [filename]" << "Learn from a file, directory or glob." << endl;
         cout << setw(25) << left << "    --markov [number]" << "Markov length (default 3)." << endl;
         cout << setw(25) << left << "    --gutenberg" << "Clean books from Gutenberg Project." << endl;
-        cout << setw(25) << left << "--database [filename]" << "Choose database." << endl;
+        cout << setw(25) << left << "    --memory [MB]" << "Approximate learning within this memory, drops rare chains." << endl;
+        cout << setw(25) << left << "    --threads [number]" << "Learn files on this many threads (default 1)." << endl;
+        cout << setw(25) << left << "--database [filename]" << "Choose database. .dsmm saves a read only model for --speak." << endl;
+        cout << setw(25) << left << "--model [tree|hash]" << "Model backend (default picks by markov length)." << endl;
 
         //Output
         cout << endl << "* Output:" << endl << endl;
         cout << setw(25) << left << "--speak" << "Speak to general output." << endl;
         cout << setw(25) << left << "    -n [number]" << "Generate n number of sentences (default 1)." << endl;
-        cout << setw(25) << left << "    --rand [number]" << "Random range. Ex. 0.1, will choose 10% top words)." << endl;
+        cout << setw(25) << left << "    --rand [number]" << "Start sentences among the top first words. Ex. 0.1, the top 10%. Next words follow their weights." << endl;
+        cout << setw(25) << left << "    --max [number]" << "Maximum words in a sentence (default 20)." << endl;
 
         //Irc
         cout << endl << "* Irc:" << endl << endl;
@@ -100,6 +121,8 @@ void printHelp()
         cout << setw(25) << left << "    --pass [oauth:password]" << "Server password." << endl;
         cout << setw(25) << left << "    --allChannels" << "Join all channels (doesn't work on twitch)." << endl;
         cout << setw(25) << left << "    --delay [seconds]" << "Delay between sentences (default 2 minutes)." << endl;
+        cout << setw(25) << left << "    --decay [factor]" << "Weight kept every delay. Ex. 0.99 (default 1, no decay)." << endl;
+        cout << setw(25) << left << "    --prune [weight]" << "Forget chains decayed under this weight (default 1)." << endl;
         cout << endl << endl;
 }
 
@@ -131,10 +154,9 @@ void userCommands()
 
 int main (int argc, char ** argv)
 {
-        // The map is the first word, the attached map is ordered by which word
-        // is used most often after it.
-        unique_ptr<map<string, unique_ptr<Word> > > mainWordList_(
-                        new map<string, unique_ptr<Word> >);
+        // The model knows the first words, and for each context of up to
+        // markovLength - 1 words, the words used after it and how often.
+        unique_ptr<Model> mainWordList_;
         unique_ptr<Database> database(new Database());
         unique_ptr<Reader> reader(new Reader());
         unique_ptr<GutenbergParser> gutenbergParser(new GutenbergParser());
@@ -163,12 +185,16 @@ int main (int argc, char ** argv)
                 { "file", required_argument, 0, 'f' },
                 { "markov", required_argument, 0, 'm' },
                 { "gutenberg", no_argument, 0, 'g' },
+                { "memory", required_argument, 0, 'e' },
+                { "threads", required_argument, 0, 'T' },
                 { "database", required_argument, 0, 'd' },
+                { "model", required_argument, 0, 'M' },
 
                 //Output
                 { "speak", no_argument, 0, 'S' },
                 { "n", required_argument, 0, 'n' },
                 { "rand", required_argument, 0, 'r' },
+                { "max", required_argument, 0, 'x' },
 
                 //Irc
                 { "irc", no_argument, 0, 'i' },
@@ -178,14 +204,16 @@ int main (int argc, char ** argv)
                 { "talkon", required_argument, 0, 't' },
                 { "pass", required_argument, 0, 'p' },
                 { "allChannels", no_argument, 0, 'a' },
-                { "delay", required_argument, 0, 'D' }
+                { "delay", required_argument, 0, 'D' },
+                { "decay", required_argument, 0, 'y' },
+                { "prune", required_argument, 0, 'P' }
 
         };
 
         int option_index = 0;
 
         int opt = 0;
-        while ((opt = getopt_long(argc, argv, "hsf:m:gd:Sn:r:iN:I:c:t:p:aD:",
+        while ((opt = getopt_long(argc, argv, "hsf:m:ge:T:d:M:Sn:r:x:iN:I:c:t:p:aD:y:P:",
                 long_options, &option_index)) != -1) {
 
                 switch (opt) {
@@ -196,12 +224,16 @@ int main (int argc, char ** argv)
                         break;
                         case 'm': markovLength = atoi(optarg); break;
                         case 'g': doGutenberg = true; break;
+                        case 'e': memoryLimit = atoi(optarg); break;
+                        case 'T': numThreads = atoi(optarg); break;
                         case 'd': databaseFile = string(optarg); break;
+                        case 'M': modelType = string(optarg); break;
 
                         // Output
                         case 'n': numSentences = atoi(optarg); break;
                         case 'S': doSpeak = true; break;
                         case 'r': randomRange = atof(optarg); break;
+                        case 'x': maxWords = atoi(optarg); break;
 
                         // Irc
                         case 'i': doIrc = true; break;
@@ -212,6 +244,8 @@ int main (int argc, char ** argv)
                         case 'p': ircBot.pass_ = optarg; break;
                         case 'a': allChannels = true; break;
                         case 'D': sentenceDelay = atoi(optarg); break;
+                        case 'y': decayFactor = atof(optarg); break;
+                        case 'P': pruneWeight = atoi(optarg); break;
 
                         // Help & error
                         case 'h': printHelp();
@@ -238,67 +272,163 @@ int main (int argc, char ** argv)
 
         //// INITIALIZE ////
         database->inputFilename_ = inputFilename;
+        database->modelType_ = modelType;
+        database->readOnly_ = !doSTDINRead && !doFileRead && !doIrc;
         mainWordList_ = database->loadFile(markovLength, databaseFile);
         voice->setMarkov(markovLength);
         voice->generateSortedVector(mainWordList_);
         if (randomRange > 1.0f)
                 randomRange = 1.0f;
 
-        voice->setRandom(mainWordList_->size() * randomRange, randomRange);
+        voice->setRandom(mainWordList_->size() * randomRange);
 
 
 
         //// MAIN ////
 
+        if (memoryLimit > 0)
+                reader->approx_.reset(new ApproxTrainer(size_t(memoryLimit) << 20));
+        reader->setModel(mainWordList_, markovLength);
+
         if (doSTDINRead) {
+                // A gzip stream is inflated on its own thread.
+                unique_ptr<GunzipBuffer> gunzip;
+                if (cin.peek() == 0x1f)
+                        gunzip.reset(new GunzipBuffer(cin));
+                istream in(gunzip ? gunzip.get() : cin.rdbuf());
+
                 if (doGutenberg) {
-                        while (cin >> *gutenbergParser >> *reader) {}
+                        // Clean, tokenize and learn on three threads.
+                        GutenbergPipeline pipeline;
+                        pipeline.run(in, *gutenbergParser, *reader);
+                } else if (gunzip) {
+                        reader->read(in);
                 } else {
                         while (cin >> *reader) {}
                 }
-                reader->generateMainTree(mainWordList_, markovLength);
-                database->save(mainWordList_, markovLength);
+                reader->generateMainTree();
+                database->save(mainWordList_, markovLength, databaseFile);
         }
 
         if (doFileRead) {
                 stringstream empty;
-                if (doGutenberg) {
-                        while (empty >> *database >> *gutenbergParser >> *reader) {}
+                vector<string> files = listInput(inputFilename);
+                if (files.size() != 1 || files[0] != inputFilename) {
+                        // A directory or a glob, read with one load and save.
+                        if (files.empty())
+                                cout << "Couldn't read " << inputFilename << endl;
+                        FilePool pool(numThreads, doGutenberg);
+                        pool.train(*reader, files);
+                } else if (doGutenberg) {
+                        GutenbergPipeline pipeline;
+                        pipeline.run(empty >> *database, *gutenbergParser,
+                                *reader);
                 } else {
-                        while (empty >> *database >> *reader) {}
+                        // Tokenize the mapped file in place.
+                        MappedFile file(inputFilename);
+                        if (!file.is_open()) {
+                                cout << "Couldn't read " << inputFilename << endl;
+                        } else if (isGzip(file.data(), file.size())) {
+                                GunzipBuffer buffer(file.data(), file.size());
+                                istream in(&buffer);
+                                reader->read(in);
+                                if (!buffer.ok_)
+                                        cout << inputFilename << " is damaged"
+                                                << endl;
+                        } else if (numThreads > 1 && !reader->approx_) {
+                                // The sketch needs the words in order.
+                                ParallelTrainer trainer(numThreads);
+                                trainer.train(*reader, mainWordList_, markovLength,
+                                        modelType, file.data(), file.size());
+                        } else {
+                                reader->read(file.data(), file.size());
+                        }
                 }
-                reader->generateMainTree(mainWordList_, markovLength);
-                database->save(mainWordList_, markovLength);
+                reader->generateMainTree();
+                database->save(mainWordList_, markovLength, databaseFile);
         }
 
         if (doSpeak && !doIrc) {
                 voice->generateSortedVector(mainWordList_);
-                for (auto& x : voice->speak(numSentences, 1))
+                for (auto& x : voice->speak(numSentences, 1, maxWords))
                         cout << x << endl;
         }
 
         if (doIrc) {
+                // Live chat is small, learn it exactly.
+                reader->approx_.reset();
+
+                // Chat is journaled, saves rewrite the database now and then.
+                if (database->openJournal(databaseFile))
+                        reader->journal_ = &database->journal_;
+                else
+                        cout << "Couldn't open the journal of " << databaseFile << endl;
+
                 // Start everything up
                 thread ircThread(&Irc::start, &ircBot);
                 thread userInputLoop(userCommands);
+                ModelPair models(mainWordList_);
+                Journal* journal = reader->journal_;
+
+                // Replies come from their own thread and read the published
+                // copy, learning never waits for them and they never wait
+                // for learning.
+                thread speaker([&]() {
+                        while (doSpeak && !quitApp) {
+                                this_thread::sleep_for(chrono::seconds(sentenceDelay));
+
+                                vector<string> sentences;
+                                {
+                                        ReadGuard lk(models);
+                                        voice->generateSortedVector(lk.model());
+                                        sentences = voice->speak(numSentences,
+                                                1, maxWords);
+                                }
+                                ircBot.say(sentences);
+                        }
+                });
 
+                auto lastSave = chrono::steady_clock::now();
                 while (!quitApp) {
-                        reader->addToHugeAssWordList(ircBot.getCachedSentences());
-                        reader->generateMainTree(mainWordList_, markovLength);
-                        database->save(mainWordList_, markovLength);
-
-                        if (doSpeak) {
-                                voice->generateSortedVector(mainWordList_);
-                                ircBot.say(voice->speak(numSentences, 1));
+                        unique_ptr<vector<Word> > chat = ircBot.getCachedSentences();
+                        bool delayOver = chrono::steady_clock::now() - lastSave
+                                >= chrono::seconds(sentenceDelay);
+
+                        // Both copies learn the batch, the journal once.
+                        models.write([&](Model& m, bool first) {
+                                reader->model_ = &m;
+                                reader->journal_ = first ? journal : nullptr;
+                                for (const auto& x : *chat)
+                                        reader->addWord(x);
+                                reader->generateMainTree();
+
+                                // Old chat fades a little every delay, a
+                                // slice at a time.
+                                if (delayOver && decayFactor < 1.0) {
+                                        m.decay(decayFactor, pruneWeight,
+                                                DECAY_WORK);
+                                        if (first)
+                                                database->journal_.decay(
+                                                        decayFactor, pruneWeight,
+                                                        DECAY_WORK);
+                                }
+                        });
+
+                        // Only this thread changes the copies.
+                        if (delayOver) {
+                                database->checkpoint(mainWordList_,
+                                        markovLength, databaseFile);
+                                lastSave = chrono::steady_clock::now();
                         }
 
-                        this_thread::sleep_for(chrono::seconds(sentenceDelay));
+                        this_thread::sleep_for(chrono::seconds(TRAIN_DELAY));
                 }
                 // Cleanup
+                speaker.join();
                 userInputLoop.join();
                 ircBot.stop.store(true);
                 ircThread.join();
-                database->save(mainWordList_, markovLength);
+                database->save(mainWordList_, markovLength, databaseFile);
         }
 
         return 0;
@@ -0,0 +1,116 @@
+/*
+ *  Copyright (C) 2014 Philippe Groarke.
+ *  Author: Philippe Groarke <philippe.groarke@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <cstdint>
+#include <fcntl.h>
+#include <streambuf>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+// 0 if f can't be read.
+inline uint64_t fileSize(const string& f)
+{
+        struct stat st;
+        return stat(f.c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+/*
+ * A whole file mapped read only. The pages are the kernel's, reading a big
+ * corpus costs no heap and no copy.
+ */
+struct MappedFile {
+        MappedFile() {}
+        MappedFile(const string& f, int advice = MADV_SEQUENTIAL)
+        {
+                open(f, advice);
+        }
+        ~MappedFile() { close(); }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        // advice is for madvise, how the pages will be read.
+        bool open(const string& f, int advice = MADV_SEQUENTIAL)
+        {
+                close();
+
+                int fd = ::open(f.c_str(), O_RDONLY);
+                if (fd < 0)
+                        return false;
+
+                struct stat st;
+                if (fstat(fd, &st) != 0) {
+                        ::close(fd);
+                        return false;
+                }
+
+                size_ = st.st_size;
+                if (size_ > 0) {
+                        void* p = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+                        if (p == MAP_FAILED) {
+                                ::close(fd);
+                                size_ = 0;
+                                return false;
+                        }
+                        data_ = static_cast<const char*>(p);
+                        madvise(p, size_, advice);
+                }
+                ::close(fd);
+                isOpen_ = true;
+                return true;
+        }
+
+        void close()
+        {
+                if (data_ != nullptr)
+                        munmap(const_cast<char*>(data_), size_);
+                data_ = nullptr;
+                size_ = 0;
+                isOpen_ = false;
+        }
+
+        bool is_open() const { return isOpen_; }
+        const char* data() const { return data_; }
+        size_t size() const { return size_; }
+
+        const char* data_ = nullptr;
+        size_t size_ = 0;
+        bool isOpen_ = false;
+};
+
+// Lets istream code read memory it doesn't own, without copying it.
+struct MemoryBuffer : public streambuf {
+        void set(const char* data, size_t size)
+        {
+                char* p = const_cast<char*>(data);
+                setg(p, p, p + size);
+        }
+
+        // Bytes read so far.
+        size_t position() const { return gptr() - eback(); }
+};
+
+#endif // MAPPEDFILE_H
@@ -0,0 +1,350 @@
+/*
+ *  Copyright (C) 2014 Philippe Groarke.
+ *  Author: Philippe Groarke <philippe.groarke@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+#ifndef MARKOVMODEL_H
+#define MARKOVMODEL_H
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include "model.hpp"
+#include "word.hpp"
+
+using namespace std;
+
+/*
+ * Model for a Markov length known at compile time. A context is a fixed
+ * array of N - 1 token ids, padded with NPOS when shorter, and one open
+ * addressing table maps it straight to its successors. Generating a word
+ * is a single lookup instead of walking the tree.
+ */
+template <int N>
+struct MarkovModel : public Model {
+        typedef array<uint32_t, N - 1> Context;
+
+        struct Slot {
+                Context key;
+                uint32_t node; // NPOS if empty.
+        };
+
+        MarkovModel() : slots_(1024, Slot{Context(), NPOS}) {}
+
+        int order() const { return N; }
+
+        void addChain(const vector<const Word*>& window)
+        {
+                Context c;
+                c.fill(NPOS);
+
+                size_t size = window.size() < N ? window.size() : N;
+                for (size_t i = 0; i < size; ++i) {
+                        store_.addEdge(current(insertNode(c)), window[i]->id_, 1,
+                                window[i]->characteristics_);
+                        if (i + 1 < N)
+                                c[i] = window[i]->id_;
+                }
+        }
+
+        void add(const uint32_t* context, size_t n, uint32_t token,
+                uint32_t weight, uint32_t flags)
+        {
+                if (n >= N)
+                        return;
+                store_.addEdge(current(insertNode(makeContext(context, n))),
+                        token, weight, flags);
+        }
+
+        // Longer contexts through the successor go along with it.
+        void remove(const uint32_t* context, size_t n, uint32_t token)
+        {
+                uint32_t node = n < N ? findNode(makeContext(context, n)) : NPOS;
+                uint32_t e = node == NPOS ? NPOS : store_.findEdge(node, token);
+                if (e == NPOS)
+                        return;
+
+                store_.removeEdge(node, e);
+                if (n + 1 < N) {
+                        Context c = makeContext(context, n);
+                        c[n] = token;
+                        freeContext(c, n + 1);
+                }
+        }
+
+        bool successors(const uint32_t* context, size_t n,
+                const Edge*& begin, const Edge*& end) const
+        {
+                uint32_t node = n < N ? findNode(makeContext(context, n)) : NPOS;
+                if (node == NPOS)
+                        return false;
+
+                begin = store_.begin(node);
+                end = store_.end(node);
+                return true;
+        }
+
+        const Edge* sample(const uint32_t* context, size_t n, mt19937& gen)
+        {
+                uint32_t node = n < N ? findNode(makeContext(context, n)) : NPOS;
+                if (node == NPOS)
+                        return nullptr;
+
+                uint32_t e = store_.sample(node, gen);
+                return e == NPOS ? nullptr : &store_.edge(e);
+        }
+
+        uint32_t weight(const uint32_t* context, size_t n, uint32_t token) const
+        {
+                uint32_t node = n < N ? findNode(makeContext(context, n)) : NPOS;
+                if (node == NPOS)
+                        return 0;
+
+                uint32_t e = store_.findEdge(node, token);
+                return e == NPOS ? 0 : store_.edge(e).weight;
+        }
+
+        size_t numSuccessors(const uint32_t* context, size_t n) const
+        {
+                uint32_t node = n < N ? findNode(makeContext(context, n)) : NPOS;
+                return node == NPOS ? 0 : store_.nodes_[node].size;
+        }
+
+        size_t memory() const
+        {
+                return store_.memory() + slots_.capacity() * sizeof(Slot);
+        }
+
+        unique_ptr<Model> clone() const
+        {
+                return unique_ptr<Model>(new MarkovModel(*this));
+        }
+
+        /*
+         * Successors are copied whole, one thread per model. Only the
+         * contexts are inserted one by one, and the first words of all
+         * the models become one.
+         */
+        void adopt(vector<unique_ptr<Model> >& from)
+        {
+                vector<EdgeStore*> stores;
+                for (auto& x : from) {
+                        MarkovModel* m = dynamic_cast<MarkovModel*>(x.get());
+                        if (m == nullptr || !store_.nodes_.empty())
+                                return Model::adopt(from);
+                        stores.push_back(&m->store_);
+                }
+
+                vector<uint32_t> at;
+                store_.append(stores, at);
+
+                size_t size = slots_.size();
+                while (size < (store_.nodes_.size() + 1) * 2)
+                        size *= 2;
+                rehash(size);
+
+                Context root;
+                root.fill(NPOS);
+                vector<Edge> roots;
+                for (size_t i = 0; i < from.size(); ++i) {
+                        const MarkovModel& m = static_cast<MarkovModel&>(*from[i]);
+                        for (auto& x : m.slots_) {
+                                if (x.node == NPOS)
+                                        continue;
+
+                                uint32_t node = at[i] + x.node;
+                                if (x.key != root) {
+                                        place(x.key, node);
+                                        continue;
+                                }
+                                roots.insert(roots.end(), store_.begin(node),
+                                        store_.end(node));
+                                store_.freeNode(node);
+                        }
+                }
+
+                sort(roots.begin(), roots.end(), [](const Edge& a,
+                        const Edge& b) -> bool {
+                        return a.token < b.token;
+                });
+                store_.assign(insertNode(root), roots.data(),
+                        roots.data() + roots.size());
+                store_.prepare();
+        }
+
+        void reserve(size_t numEdges) { store_.reserve(numEdges); }
+
+        void prepare() { store_.prepare(); }
+
+        // Contexts left without successors are dropped, the root context stays.
+        void decaySlice(float factor, uint32_t threshold, size_t work)
+        {
+                work = min(work, slots_.size());
+                while (work > 0) {
+                        if (cursor_ >= slots_.size())
+                                cursor_ = 0;
+
+                        Slot& s = slots_[cursor_];
+                        if (s.node != NPOS) {
+                                store_.decayNode(s.node, epoch_, factor,
+                                        threshold, [](const Edge&) {});
+                                if (store_.nodes_[s.node].size == 0
+                                                && s.key[0] != NPOS) {
+                                        store_.freeNode(s.node);
+                                        erase(cursor_); // Look at what moved in.
+                                        continue;
+                                }
+                        }
+                        ++cursor_;
+                        --work;
+                }
+        }
+
+        EdgeStore store_;
+        vector<Slot> slots_; // Power of 2.
+        size_t cursor_ = 0; // Next slot to decay.
+
+private:
+        // The node, decayed up to epoch_ before it learns more.
+        uint32_t current(uint32_t node)
+        {
+                store_.decayNode(node, epoch_, decayFactor_, decayThreshold_,
+                        [](const Edge&) {});
+                return node;
+        }
+
+        static Context makeContext(const uint32_t* context, size_t n)
+        {
+                Context c;
+                c.fill(NPOS);
+                for (size_t i = 0; i < n; ++i)
+                        c[i] = context[i];
+                return c;
+        }
+
+        static size_t hash(const Context& c)
+        {
+                uint64_t h = 0;
+                for (int i = 0; i < N - 1; ++i)
+                        h = (h ^ c[i]) * 0x9E3779B97F4A7C15ULL;
+                return h ^ (h >> 32);
+        }
+
+        uint32_t findNode(const Context& c) const
+        {
+                return slots_[findSlot(c)].node;
+        }
+
+        // Slot of the context, or the empty slot where it would go.
+        size_t findSlot(const Context& c) const
+        {
+                size_t mask = slots_.size() - 1;
+                for (size_t i = hash(c) & mask;; i = (i + 1) & mask) {
+                        if (slots_[i].node == NPOS || slots_[i].key == c)
+                                return i;
+                }
+        }
+
+        // Drop a context of n tokens and every longer one it starts.
+        void freeContext(Context& c, size_t n)
+        {
+                uint32_t node = findNode(c);
+                if (node == NPOS)
+                        return;
+
+                if (n + 1 < N) {
+                        vector<uint32_t> next;
+                        for (const Edge* x = store_.begin(node);
+                                        x != store_.end(node); ++x)
+                                next.push_back(x->token);
+                        for (auto tok : next) {
+                                c[n] = tok;
+                                freeContext(c, n + 1);
+                        }
+                        c[n] = NPOS;
+                }
+
+                // Erasing the longer ones may have moved its slot.
+                store_.freeNode(node);
+                erase(findSlot(c));
+        }
+
+        uint32_t insertNode(const Context& c)
+        {
+                if ((store_.nodes_.size() + 1) * 2 > slots_.size())
+                        rehash(slots_.size() * 2);
+
+                size_t mask = slots_.size() - 1;
+                for (size_t i = hash(c) & mask;; i = (i + 1) & mask) {
+                        if (slots_[i].node == NPOS) {
+                                slots_[i].key = c;
+                                slots_[i].node = store_.newNode(epoch_);
+                                return slots_[i].node;
+                        }
+                        if (slots_[i].key == c)
+                                return slots_[i].node;
+                }
+        }
+
+        // A context known not to be in the table yet, with its node.
+        void place(const Context& c, uint32_t node)
+        {
+                size_t mask = slots_.size() - 1;
+                size_t i = hash(c) & mask;
+                while (slots_[i].node != NPOS)
+                        i = (i + 1) & mask;
+                slots_[i] = Slot{c, node};
+        }
+
+        // Backward shift deletion, keeps probe chains whole without tombstones.
+        void erase(size_t i)
+        {
+                size_t mask = slots_.size() - 1;
+                for (size_t j = i;;) {
+                        slots_[i].node = NPOS;
+                        size_t k = 0;
+                        do {
+                                j = (j + 1) & mask;
+                                if (slots_[j].node == NPOS)
+                                        return;
+                                k = hash(slots_[j].key) & mask;
+                        } while (i <= j ? (i < k && k <= j) : (i < k || k <= j));
+                        slots_[i] = slots_[j];
+                        i = j;
+                }
+        }
+
+        void rehash(size_t size)
+        {
+                vector<Slot> temp(size, Slot{Context(), NPOS});
+                size_t mask = size - 1;
+                for (auto& x : slots_) {
+                        if (x.node == NPOS)
+                                continue;
+                        size_t i = hash(x.key) & mask;
+                        while (temp[i].node != NPOS)
+                                i = (i + 1) & mask;
+                        temp[i] = x;
+                }
+                slots_.swap(temp);
+        }
+};
+
+#endif // MARKOVMODEL_H
@@ -0,0 +1,1140 @@
+/*
+ *  Copyright (C) 2014 Philippe Groarke.
+ *  Author: Philippe Groarke <philippe.groarke@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+#ifndef MODEL_H
+#define MODEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "compression.hpp"
+#include "mappedfile.hpp"
+#include "varint.hpp"
+#include "word.hpp"
+
+using namespace std;
+
+/*
+ * One successor: its token (an id from symbols()), how many times it was
+ * seen, its characteristics and, in a tree, the node holding its own
+ * successors.
+ */
+struct Edge {
+        uint32_t token;
+        uint32_t weight;
+        uint32_t flags;
+        uint32_t child; // NPOS if no successors yet.
+};
+
+/*
+ * A weight multiplied by keep, rounded up with a chance equal to the
+ * fraction so that small counts decay at the same rate as large ones on
+ * average. The chance comes from a hash of seed, the same edge and epoch
+ * always round the same way.
+ */
+inline uint32_t decayWeight(uint32_t weight, double keep, uint64_t seed)
+{
+        seed ^= seed >> 33;
+        seed *= 0xFF51AFD7ED558CCDULL;
+        seed ^= seed >> 33;
+        seed *= 0xC4CEB9FE1A85EC53ULL;
+        seed ^= seed >> 33;
+
+        double x = weight * keep;
+        double whole = floor(x);
+        double chance = (seed >> 11) * (1.0 / (uint64_t(1) << 53));
+        return uint32_t(whole) + (chance < x - whole ? 1 : 0);
+}
+
+// Seed for decayWeight(), a pair of ids and the epoch.
+inline uint64_t decaySeed(uint64_t key, uint32_t epoch)
+{
+        return key ^ (epoch * 0x9E3779B97F4A7C15ULL);
+}
+
+/*
+ * Flat successor lists. Every node owns a contiguous range of edges_ (CSR
+ * style), sorted by token id.
+ *
+ * cumulative_ runs parallel to edges_ and holds the running sum of weights
+ * of each range, so picking a weighted successor is a binary search. It is
+ * rebuilt lazily, only for nodes whose counts changed since the last pick,
+ * or all at once by prepare().
+ */
+struct EdgeStore {
+        struct Node {
+                uint32_t first = 0;
+                uint32_t size = 0;
+                uint32_t capacity = 0;
+                uint32_t epoch = 0; // Last decay applied.
+                bool dirty = false; // cumulative_ needs a rebuild.
+        };
+
+        uint32_t newNode(uint32_t epoch = 0)
+        {
+                uint32_t ret = 0;
+                if (!freeNodes_.empty()) {
+                        ret = freeNodes_.back();
+                        freeNodes_.pop_back();
+                } else {
+                        ret = nodes_.size();
+                        nodes_.push_back(Node());
+                }
+                nodes_[ret].epoch = epoch;
+                return ret;
+        }
+
+        // Drop the successors of a node and give its range back.
+        void clearNode(uint32_t node)
+        {
+                Node& n = nodes_[node];
+                release(n.first, n.capacity);
+                n = Node();
+        }
+
+        // The node id can be handed out again by newNode().
+        void freeNode(uint32_t node)
+        {
+                clearNode(node);
+                freeNodes_.push_back(node);
+        }
+
+        // Grab room up front so a load is a few large allocations.
+        void reserve(size_t numEdges)
+        {
+                edges_.reserve(numEdges);
+                cumulative_.reserve(numEdges);
+                nodes_.reserve(numEdges / 2);
+        }
+
+        const Edge* begin(uint32_t node) const
+        {
+                return edges_.data() + nodes_[node].first;
+        }
+
+        const Edge* end(uint32_t node) const
+        {
+                return begin(node) + nodes_[node].size;
+        }
+
+        const Edge& edge(uint32_t e) const { return edges_[e]; }
+        Edge& edge(uint32_t e) { return edges_[e]; }
+
+        // Index in edges_ of the token, or NPOS.
+        uint32_t findEdge(uint32_t node, uint32_t tok) const
+        {
+                const Edge* b = begin(node);
+                const Edge* e = end(node);
+                const Edge* it = lower_bound(b, e, tok,
+                        [](const Edge& x, uint32_t t) -> bool {
+                                return x.token < t;
+                });
+                if (it == e || it->token != tok)
+                        return NPOS;
+                return it - edges_.data();
+        }
+
+        // Add weight to a successor, inserting it if needed. Returns its
+        // index in edges_, valid until this node gets another new successor.
+        uint32_t addEdge(uint32_t node, uint32_t tok, uint32_t weight,
+                uint32_t flags)
+        {
+                Node& n = nodes_[node];
+                Edge* b = edges_.data() + n.first;
+                Edge* e = b + n.size;
+                Edge* it = lower_bound(b, e, tok,
+                        [](const Edge& x, uint32_t t) -> bool {
+                                return x.token < t;
+                });
+
+                touch(node);
+                if (it != e && it->token == tok) {
+                        it->weight += weight;
+                        it->flags |= flags;
+                        return it - edges_.data();
+                }
+
+                uint32_t pos = it - b;
+                if (n.size == n.capacity)
+                        grow(node, n.size);
+
+                Node& g = nodes_[node];
+                b = edges_.data() + g.first;
+                move_backward(b + pos, b + g.size, b + g.size + 1);
+                b[pos] = Edge{tok, weight, flags, NPOS};
+                ++g.size;
+                return g.first + pos;
+        }
+
+        // Take a successor out of its node, by its index in edges_.
+        void removeEdge(uint32_t node, uint32_t e)
+        {
+                Node& n = nodes_[node];
+                copy(edges_.begin() + e + 1, edges_.begin() + n.first + n.size,
+                        edges_.begin() + e);
+                --n.size;
+                touch(node);
+        }
+
+        // Replace the successors of a node, they must be sorted by token.
+        void assign(uint32_t node, const Edge* b, const Edge* e)
+        {
+                uint32_t size = e - b;
+                if (size > nodes_[node].capacity) {
+                        nodes_[node].size = 0;
+                        grow(node, size - 1);
+                }
+
+                Node& n = nodes_[node];
+                copy(b, e, edges_.begin() + n.first);
+                n.size = size;
+                touch(node);
+        }
+
+        // Weighted random successor, as an index in edges_. NPOS if none.
+        template <class Gen>
+        uint32_t sample(uint32_t node, Gen& gen)
+        {
+                Node& n = nodes_[node];
+                if (n.size == 0)
+                        return NPOS;
+
+                if (n.dirty)
+                        buildCumulative(node);
+
+                const uint64_t* c = cumulative_.data() + n.first;
+                uint64_t total = c[n.size - 1];
+                if (total == 0)
+                        return NPOS;
+
+                uniform_int_distribution<uint64_t> distribution(0, total - 1);
+                const uint64_t* it = upper_bound(c, c + n.size,
+                        distribution(gen));
+                return n.first + (it - c);
+        }
+
+        /*
+         * Bring a node up to epoch, its weights are multiplied by factor for
+         * every epoch it missed. Successors falling under threshold are
+         * removed and handed to onRemove.
+         */
+        template <class F>
+        void decayNode(uint32_t node, uint32_t epoch, float factor,
+                uint32_t threshold, F onRemove)
+        {
+                if (nodes_[node].epoch >= epoch)
+                        return;
+
+                double keep = pow(double(factor), double(epoch - nodes_[node].epoch));
+                nodes_[node].epoch = epoch;
+
+                uint32_t first = nodes_[node].first;
+                uint32_t out = first;
+                for (uint32_t i = first; i < first + nodes_[node].size; ++i) {
+                        Edge x = edges_[i];
+                        x.weight = decayWeight(x.weight, keep, decaySeed(
+                                (uint64_t(node) << 32) | x.token, epoch));
+                        if (x.weight < threshold) {
+                                onRemove(x);
+                                continue;
+                        }
+                        edges_[out++] = x;
+                }
+                nodes_[node].size = out - first;
+                touch(node);
+        }
+
+        // Freed nodes and ranges will be used again, they don't count.
+        size_t memory() const
+        {
+                size_t ret = nodes_.capacity() * sizeof(Node)
+                        + edges_.capacity() * sizeof(Edge)
+                        + cumulative_.capacity() * sizeof(uint64_t);
+                for (auto& x : freeRanges_)
+                        ret += x.capacity() * sizeof(uint32_t);
+                ret += (freeNodes_.capacity() + dirtyNodes_.capacity())
+                        * sizeof(uint32_t);
+
+                size_t unused = freeNodes_.size() * sizeof(Node)
+                        + free_ * (sizeof(Edge) + sizeof(uint64_t));
+                return ret - min(ret, unused);
+        }
+
+        // Rewrite the edges so every range is tight, in node order.
+        void compact()
+        {
+                vector<Edge> temp;
+                temp.reserve(edges_.size() - free_);
+
+                for (uint32_t node = 0; node < nodes_.size(); ++node) {
+                        Node& n = nodes_[node];
+                        uint32_t first = temp.size();
+                        temp.insert(temp.end(), edges_.begin() + n.first,
+                                edges_.begin() + n.first + n.size);
+                        n.first = first;
+                        n.capacity = n.size;
+                        touch(node);
+                }
+
+                edges_.swap(temp);
+                cumulative_.assign(edges_.size(), 0);
+                for (auto& x : freeRanges_)
+                        x.clear();
+                free_ = 0;
+        }
+
+        // Rebuild every cumulative_ range that changed. Picking successors
+        // then only reads the store, from as many threads as needed.
+        void prepare()
+        {
+                for (auto node : dirtyNodes_) {
+                        if (nodes_[node].dirty)
+                                buildCumulative(node);
+                }
+                dirtyNodes_.clear();
+        }
+
+        /*
+         * Copy the nodes and edges of other stores after the ones here, one
+         * thread per store. at gets where node 0 of each store went, every
+         * node and child keeps its place relative to it. The stores are
+         * compacted first.
+         */
+        void append(const vector<EdgeStore*>& from, vector<uint32_t>& at)
+        {
+                vector<thread> pool;
+                for (auto x : from)
+                        pool.push_back(thread(&EdgeStore::compact, x));
+                for (auto& t : pool)
+                        t.join();
+                pool.clear();
+
+                at.resize(from.size());
+                vector<size_t> edgeAt(from.size());
+                size_t nodes = nodes_.size();
+                size_t edges = edges_.size();
+                for (size_t i = 0; i < from.size(); ++i) {
+                        at[i] = nodes;
+                        edgeAt[i] = edges;
+                        nodes += from[i]->nodes_.size();
+                        edges += from[i]->edges_.size();
+                }
+                nodes_.resize(nodes);
+                edges_.resize(edges);
+                cumulative_.resize(edges);
+
+                for (size_t i = 0; i < from.size(); ++i) {
+                        pool.push_back(thread([&, i]() {
+                                const EdgeStore& x = *from[i];
+                                for (uint32_t n = 0; n < x.nodes_.size(); ++n) {
+                                        Node node = x.nodes_[n];
+                                        uint64_t sum = 0;
+                                        for (uint32_t e = node.first;
+                                                        e < node.first + node.size; ++e) {
+                                                Edge y = x.edges_[e];
+                                                if (y.child != NPOS)
+                                                        y.child += at[i];
+                                                sum += y.weight;
+                                                edges_[edgeAt[i] + e] = y;
+                                                cumulative_[edgeAt[i] + e] = sum;
+                                        }
+
+                                        node.first += edgeAt[i];
+                                        node.dirty = false;
+                                        nodes_[at[i] + n] = node;
+                                }
+                        }));
+                }
+                for (auto& t : pool)
+                        t.join();
+
+                for (size_t i = 0; i < from.size(); ++i) {
+                        for (auto n : from[i]->freeNodes_)
+                                freeNodes_.push_back(at[i] + n);
+                }
+        }
+
+        vector<Node> nodes_;
+        vector<Edge> edges_;
+        vector<uint64_t> cumulative_;
+        vector<uint32_t> dirtyNodes_;
+        size_t free_ = 0; // Edges left behind when a range moved.
+
+        // Ranges left behind, by the power of 2 they can hold. Growing
+        // nodes take them before appending to edges_.
+        vector<uint32_t> freeRanges_[32];
+        vector<uint32_t> freeNodes_;
+
+private:
+        void touch(uint32_t node)
+        {
+                if (!nodes_[node].dirty) {
+                        nodes_[node].dirty = true;
+                        dirtyNodes_.push_back(node);
+                }
+        }
+
+        void buildCumulative(uint32_t node)
+        {
+                Node& n = nodes_[node];
+                uint64_t sum = 0;
+                for (uint32_t i = n.first; i < n.first + n.size; ++i) {
+                        sum += edges_[i].weight;
+                        cumulative_[i] = sum;
+                }
+                n.dirty = false;
+        }
+
+        // Power of 2 room for one more edge than size.
+        static int sizeClass(uint32_t size, uint32_t& capacity)
+        {
+                int ret = 1;
+                capacity = 2;
+                while (capacity <= size) {
+                        capacity *= 2;
+                        ++ret;
+                }
+                return ret;
+        }
+
+        // Keep a range left behind for reuse, under the largest power of 2
+        // it can hold.
+        void release(uint32_t first, uint32_t capacity)
+        {
+                if (capacity == 0)
+                        return;
+
+                int c = 0;
+                while ((2u << c) <= capacity)
+                        ++c;
+                freeRanges_[c].push_back(first);
+                free_ += capacity;
+        }
+
+        // Move a range to a free range or the end of edges_, with room for
+        // more than size edges.
+        void grow(uint32_t node, uint32_t size)
+        {
+                if (free_ > edges_.size() / 2)
+                        compact();
+
+                Node& n = nodes_[node];
+                uint32_t capacity = 0;
+                int c = sizeClass(size, capacity);
+
+                // Last range in the array, just extend it.
+                if (n.first + n.capacity == edges_.size()) {
+                        edges_.resize(n.first + capacity);
+                        cumulative_.resize(edges_.size());
+                        n.capacity = capacity;
+                        return;
+                }
+
+                uint32_t first = 0;
+                if (!freeRanges_[c].empty()) {
+                        first = freeRanges_[c].back();
+                        freeRanges_[c].pop_back();
+                        free_ -= capacity;
+                } else {
+                        first = edges_.size();
+                        edges_.resize(first + capacity);
+                        cumulative_.resize(edges_.size());
+                }
+
+                copy(edges_.begin() + n.first, edges_.begin() + n.first + n.size,
+                        edges_.begin() + first);
+                release(n.first, n.capacity);
+                n.first = first;
+                n.capacity = capacity;
+        }
+};
+
+/*
+ * What Reader, Voice and Database need from a model. A context is the list
+ * of tokens leading to a set of successors, the empty context holds the
+ * first words. Contexts are at most order() - 1 tokens long.
+ */
+struct Model {
+        virtual ~Model() {}
+
+        virtual int order() const = 0;
+
+        // Add a window of words, the first one being a root word.
+        virtual void addChain(const vector<const Word*>& window) = 0;
+
+        // Add weight to the token following context.
+        virtual void add(const uint32_t* context, size_t n, uint32_t token,
+                uint32_t weight, uint32_t flags) = 0;
+
+        // Forget the token following context, along with what follows it.
+        virtual void remove(const uint32_t* context, size_t n,
+                uint32_t token) = 0;
+
+        // Successors of a context, valid until the model changes.
+        virtual bool successors(const uint32_t* context, size_t n,
+                const Edge*& begin, const Edge*& end) const = 0;
+
+        // Weighted random successor of a context, nullptr if none.
+        virtual const Edge* sample(const uint32_t* context, size_t n,
+                mt19937& gen) = 0;
+
+        // Weight of the token following context, 0 if never seen.
+        virtual uint32_t weight(const uint32_t* context, size_t n,
+                uint32_t token) const = 0;
+
+        // How many different tokens followed context.
+        virtual size_t numSuccessors(const uint32_t* context, size_t n) const = 0;
+
+        // Bytes held by the model, the symbols aside.
+        virtual size_t memory() const = 0;
+
+        // A copy that shares nothing with this model, for snapshots.
+        virtual unique_ptr<Model> clone() const = 0;
+
+        /*
+         * Start a new decay period, every weight gets multiplied by factor
+         * once per call and what falls under threshold is forgotten. Only
+         * `work` contexts are brought up to date per call, the sweep goes
+         * on from there next time. factor must stay the same between calls.
+         * A context the sweep hasn't reached is brought up to date before
+         * it learns more, new counts don't pay for epochs they missed.
+         */
+        void decay(float factor, uint32_t threshold, size_t work)
+        {
+                ++epoch_;
+                decayFactor_ = factor;
+                decayThreshold_ = threshold;
+                decaySlice(factor, threshold, work);
+        }
+
+        virtual void decaySlice(float factor, uint32_t threshold,
+                size_t work) = 0;
+
+        uint32_t epoch_ = 0;
+        float decayFactor_ = 1; // Of the last decay().
+        uint32_t decayThreshold_ = 0;
+
+        virtual void reserve(size_t numEdges) {}
+
+        // Settle lazy state, after which reads never write to the model.
+        virtual void prepare() = 0;
+
+        // Number of first words, like the old root map.
+        size_t size() const
+        {
+                const Edge* b = nullptr;
+                const Edge* e = nullptr;
+                if (!successors(nullptr, 0, b, e))
+                        return 0;
+                return e - b;
+        }
+
+        void printInfo() const
+        {
+                vector<uint32_t> path;
+                printEdges(path);
+        }
+
+        // Same text layout the Word tree used, so old databases still load.
+        void write(ostream& os) const
+        {
+                vector<uint32_t> path;
+                writeEdges(os, path);
+        }
+
+        void read(istream& is)
+        {
+                vector<uint32_t> path;
+                size_t size = 0;
+                is >> size;
+                readEdges(is, path, size);
+        }
+
+        /*
+         * Binary layout, see varint.hpp. The tokens in use are written once
+         * up front and edges refer to them by position. Then comes an index
+         * of the first words, each with the size of its context, and those
+         * contexts one after the other. A context is its number of
+         * successors, then per successor its token, weight, flags and its
+         * own context.
+         *
+         * The token table and the contexts are zlib compressed, contexts in
+         * blocks of about DSMC_BLOCK bytes that each inflate on their own.
+         * The block index says how many first words each block holds.
+         */
+        void writeBinary(ostream& os) const
+        {
+                vector<uint32_t> path;
+                vector<uint32_t> local;
+                vector<uint32_t> table;
+                uint64_t numEdges = 0;
+                collectTokens(path, local, table, numEdges);
+
+                stringbuf tokens;
+                writeVarint(&tokens, table.size());
+                for (auto id : table) {
+                        const string& w = symbols().str(id);
+                        writeVarint(&tokens, w.size());
+                        tokens.sputn(w.data(), w.size());
+                }
+
+                streambuf* sb = os.rdbuf();
+                writeBlock(sb, tokens.str());
+                writeVarint(sb, numEdges);
+
+                const Edge* b = nullptr;
+                const Edge* e = nullptr;
+                successors(nullptr, 0, b, e);
+
+                vector<uint64_t> sizes;
+                vector<uint32_t> counts;
+                vector<uint64_t> rawSizes;
+                vector<string> blocks;
+                string raw;
+                uint32_t count = 0;
+                for (const Edge* x = b; x != e; ++x) {
+                        stringbuf context;
+                        path.assign(1, x->token);
+                        writeContext(&context, path, local);
+                        sizes.push_back(context.str().size());
+                        raw += context.str();
+
+                        ++count;
+                        if (raw.size() >= DSMC_BLOCK || x + 1 == e) {
+                                counts.push_back(count);
+                                rawSizes.push_back(raw.size());
+                                blocks.push_back(deflateBlock(raw));
+                                raw.clear();
+                                count = 0;
+                        }
+                }
+
+                writeVarint(sb, e - b);
+                for (const Edge* x = b; x != e; ++x) {
+                        writeVarint(sb, local[x->token]);
+                        writeVarint(sb, x->weight);
+                        writeVarint(sb, x->flags);
+                        writeVarint(sb, sizes[x - b]);
+                }
+
+                writeVarint(sb, blocks.size());
+                for (size_t i = 0; i < blocks.size(); ++i) {
+                        writeVarint(sb, counts[i]);
+                        writeVarint(sb, rawSizes[i]);
+                        writeVarint(sb, blocks[i].size());
+                }
+                for (auto& x : blocks)
+                        sb->sputn(x.data(), x.size());
+        }
+
+        // False if the input is cut short or damaged.
+        bool readBinary(istream& is, uint64_t version = DSMC_VERSION)
+        {
+                streambuf* sb = is.rdbuf();
+                vector<uint32_t> ids;
+                if (version >= 3) {
+                        string tokens;
+                        MemoryBuffer buffer;
+                        if (!readBlock(sb, tokens))
+                                return false;
+                        buffer.set(tokens.data(), tokens.size());
+                        if (!readTokens(&buffer, ids))
+                                return false;
+                } else if (!readTokens(sb, ids)) {
+                        return false;
+                }
+
+                uint64_t numEdges = 0;
+                if (!readVarint(sb, numEdges) || numEdges > NPOS)
+                        return false;
+                reserve(numEdges);
+
+                // Version 1 has no index, the root is a context like any other.
+                vector<uint32_t> path;
+                if (version < 2)
+                        return readContext(sb, ids, path);
+
+                vector<uint32_t> roots;
+                if (!readIndex(sb, ids, roots, nullptr))
+                        return false;
+                for (size_t i = 0; i < roots.size() && version < 3; ++i) {
+                        path.assign(1, roots[i]);
+                        if (!readContext(sb, ids, path))
+                                return false;
+                }
+                return version < 3 || readBlocks(sb, ids, roots);
+        }
+
+        /*
+         * The index of first words, each added to the model. sizes gets the
+         * size of their context if it isn't null.
+         */
+        bool readIndex(streambuf* sb, const vector<uint32_t>& ids,
+                vector<uint32_t>& roots, vector<uint64_t>* sizes)
+        {
+                uint64_t numRoots = 0;
+                if (!readVarint(sb, numRoots))
+                        return false;
+
+                for (uint64_t i = 0; i < numRoots; ++i) {
+                        uint64_t tok = 0;
+                        uint64_t weight = 0;
+                        uint64_t flags = 0;
+                        uint64_t size = 0;
+                        if (!readVarint(sb, tok) || !readVarint(sb, weight)
+                        || !readVarint(sb, flags) || !readVarint(sb, size)
+                        || tok >= ids.size())
+                                return false;
+
+                        add(nullptr, 0, ids[tok], weight, flags);
+                        roots.push_back(ids[tok]);
+                        if (sizes != nullptr)
+                                sizes->push_back(size);
+                }
+                return true;
+        }
+
+        // The token table of the binary layout, interned.
+        static bool readTokens(streambuf* sb, vector<uint32_t>& ids)
+        {
+                uint64_t size = 0;
+                if (!readVarint(sb, size))
+                        return false;
+
+                string w;
+                for (uint64_t i = 0; i < size; ++i) {
+                        uint64_t n = 0;
+                        if (!readVarint(sb, n) || n > MAX_TOKEN_SIZE)
+                                return false;
+                        w.resize(n);
+                        if (sb->sgetn(&w[0], n) != streamsize(n))
+                                return false;
+                        ids.push_back(symbols().intern(w));
+                }
+                return true;
+        }
+
+        // A compressed section is its raw size, its size and the zlib data.
+        static void writeBlock(streambuf* sb, const string& raw)
+        {
+                string packed = deflateBlock(raw);
+                writeVarint(sb, raw.size());
+                writeVarint(sb, packed.size());
+                sb->sputn(packed.data(), packed.size());
+        }
+
+        static bool readBlock(streambuf* sb, string& raw)
+        {
+                uint64_t rawSize = 0;
+                uint64_t size = 0;
+                if (!readVarint(sb, rawSize) || !readVarint(sb, size)
+                || size > MAX_BLOCK_SIZE)
+                        return false;
+
+                string packed(size, '\0');
+                return sb->sgetn(&packed[0], size) == streamsize(size)
+                        && inflateBlock(packed.data(), size, rawSize, raw);
+        }
+
+        /*
+         * One block of the index: how many first words have their context
+         * in it, its raw size and its compressed size.
+         */
+        struct Block {
+                uint64_t count;
+                uint64_t rawSize;
+                uint64_t size;
+        };
+
+        static bool readBlockIndex(streambuf* sb, vector<Block>& blocks,
+                uint64_t numRoots)
+        {
+                uint64_t numBlocks = 0;
+                if (!readVarint(sb, numBlocks) || numBlocks > numRoots)
+                        return false;
+
+                uint64_t total = 0;
+                for (uint64_t i = 0; i < numBlocks; ++i) {
+                        Block b;
+                        if (!readVarint(sb, b.count) || !readVarint(sb, b.rawSize)
+                        || !readVarint(sb, b.size) || b.size > MAX_BLOCK_SIZE)
+                                return false;
+                        total += b.count;
+                        blocks.push_back(b);
+                }
+                return total == numRoots;
+        }
+
+        /*
+         * The contexts of every first word. Blocks are read a batch at a
+         * time and the batch inflates on all cores while the contexts are
+         * added in order.
+         */
+        bool readBlocks(streambuf* sb, const vector<uint32_t>& ids,
+                const vector<uint32_t>& roots)
+        {
+                vector<Block> blocks;
+                if (!readBlockIndex(sb, blocks, roots.size()))
+                        return false;
+
+                size_t threads = max(1u, thread::hardware_concurrency());
+                size_t batch = threads * 4;
+                size_t root = 0;
+                vector<uint32_t> path;
+                for (size_t first = 0; first < blocks.size(); first += batch) {
+                        size_t n = min(batch, blocks.size() - first);
+                        vector<string> packed(n);
+                        vector<string> raw(n);
+                        for (size_t i = 0; i < n; ++i) {
+                                uint64_t size = blocks[first + i].size;
+                                packed[i].resize(size);
+                                if (sb->sgetn(&packed[i][0], size) != streamsize(size))
+                                        return false;
+                        }
+
+                        atomic<size_t> next(0);
+                        atomic_bool ok(true);
+                        vector<thread> pool;
+                        for (size_t t = 0; t < min(threads, n); ++t) {
+                                pool.push_back(thread([&]() {
+                                        for (size_t i = next++; i < n; i = next++) {
+                                                if (!inflateBlock(packed[i].data(),
+                                                        packed[i].size(),
+                                                        blocks[first + i].rawSize,
+                                                        raw[i]))
+                                                        ok = false;
+                                        }
+                                }));
+                        }
+                        for (auto& t : pool)
+                                t.join();
+                        if (!ok)
+                                return false;
+
+                        for (size_t i = 0; i < n; ++i) {
+                                MemoryBuffer buffer;
+                                buffer.set(raw[i].data(), raw[i].size());
+                                for (uint64_t j = 0; j < blocks[first + i].count; ++j) {
+                                        path.assign(1, roots[root++]);
+                                        if (!readContext(&buffer, ids, path))
+                                                return false;
+                                }
+                        }
+                }
+                return true;
+        }
+
+        /*
+         * One context and everything under it, in the binary layout. Tokens
+         * are written as local[token] and read back as ids[token].
+         */
+        void writeContext(streambuf* sb, vector<uint32_t>& path,
+                const vector<uint32_t>& local) const
+        {
+                const Edge* b = nullptr;
+                const Edge* e = nullptr;
+                if (path.size() >= size_t(order())
+                || !successors(path.data(), path.size(), b, e)) {
+                        writeVarint(sb, 0);
+                        return;
+                }
+
+                writeVarint(sb, e - b);
+                for (const Edge* x = b; x != e; ++x) {
+                        writeVarint(sb, local[x->token]);
+                        writeVarint(sb, x->weight);
+                        writeVarint(sb, x->flags);
+
+                        path.push_back(x->token);
+                        writeContext(sb, path, local);
+                        path.pop_back();
+                }
+        }
+
+        // False if the input is cut short or damaged.
+        bool readContext(streambuf* sb, const vector<uint32_t>& ids,
+                vector<uint32_t>& path)
+        {
+                uint64_t size = 0;
+                if (!readVarint(sb, size))
+                        return false;
+                if (size > 0 && path.size() >= size_t(order()))
+                        return false;
+
+                for (uint64_t i = 0; i < size; ++i) {
+                        uint64_t tok = 0;
+                        uint64_t weight = 0;
+                        uint64_t flags = 0;
+                        if (!readVarint(sb, tok) || !readVarint(sb, weight)
+                        || !readVarint(sb, flags) || tok >= ids.size())
+                                return false;
+
+                        add(path.data(), path.size(), ids[tok], weight, flags);
+
+                        path.push_back(ids[tok]);
+                        bool ok = readContext(sb, ids, path);
+                        path.pop_back();
+                        if (!ok)
+                                return false;
+                }
+                return true;
+        }
+
+        // Add every count of another model to this one.
+        void merge(const Model& from)
+        {
+                vector<uint32_t> path;
+                mergeEdges(from, path);
+        }
+
+        // Only one first word of another model and what follows it.
+        void merge(const Model& from, const Edge& first)
+        {
+                add(nullptr, 0, first.token, first.weight, first.flags);
+
+                vector<uint32_t> path(1, first.token);
+                mergeEdges(from, path);
+        }
+
+        /*
+         * Take the counts of models that have no first word in common, into
+         * a model that is still empty. Backends that can copy them side by
+         * side do it on one thread per model, the others merge them one
+         * after the other. The models are left in any state.
+         */
+        virtual void adopt(vector<unique_ptr<Model> >& from)
+        {
+                for (auto& x : from)
+                        merge(*x);
+        }
+
+private:
+        void printEdges(vector<uint32_t>& path) const
+        {
+                const Edge* b = nullptr;
+                const Edge* e = nullptr;
+                if (!successors(path.data(), path.size(), b, e))
+                        return;
+
+                for (const Edge* x = b; x != e; ++x) {
+                        for (size_t i = 0; i < path.size(); ++i)
+                                cout << "  ";
+
+                        string charact;
+                        for (const auto& c : characteristicsToStrings(x->flags))
+                                charact += " (" + c + ")";
+
+                        cout << "\"" << symbols().str(x->token) << "\" "
+                                << x->weight << charact << endl;
+
+                        if (path.size() + 1 < size_t(order())) {
+                                path.push_back(x->token);
+                                printEdges(path);
+                                path.pop_back();
+                        }
+                }
+        }
+
+        void writeEdges(ostream& os, vector<uint32_t>& path) const
+        {
+                const Edge* b = nullptr;
+                const Edge* e = nullptr;
+                if (path.size() >= size_t(order())
+                || !successors(path.data(), path.size(), b, e)) {
+                        os << 0 << endl;
+                        return;
+                }
+
+                os << e - b << endl;
+                for (const Edge* x = b; x != e; ++x) {
+                        const string& w = symbols().str(x->token);
+                        os << w << endl << w << endl << x->weight << endl;
+
+                        vector<string> chars = characteristicsToStrings(x->flags);
+                        os << chars.size() << endl;
+                        for (auto& c : chars)
+                                os << c << endl;
+
+                        path.push_back(x->token);
+                        writeEdges(os, path);
+                        path.pop_back();
+                }
+        }
+
+        // Tokens in order of first use, and how many edges there are.
+        void collectTokens(vector<uint32_t>& path, vector<uint32_t>& local,
+                vector<uint32_t>& table, uint64_t& numEdges) const
+        {
+                const Edge* b = nullptr;
+                const Edge* e = nullptr;
+                if (path.size() >= size_t(order())
+                || !successors(path.data(), path.size(), b, e))
+                        return;
+
+                numEdges += e - b;
+                for (const Edge* x = b; x != e; ++x) {
+                        // Sized as we go, the symbols may be growing on
+                        // another thread.
+                        if (x->token >= local.size())
+                                local.resize(x->token + 1, NPOS);
+                        if (local[x->token] == NPOS) {
+                                local[x->token] = table.size();
+                                table.push_back(x->token);
+                        }
+
+                        path.push_back(x->token);
+                        collectTokens(path, local, table, numEdges);
+                        path.pop_back();
+                }
+        }
+
+        void mergeEdges(const Model& from, vector<uint32_t>& path)
+        {
+                const Edge* b = nullptr;
+                const Edge* e = nullptr;
+                if (path.size() >= size_t(from.order())
+                || !from.successors(path.data(), path.size(), b, e))
+                        return;
+
+                for (const Edge* x = b; x != e; ++x) {
+                        add(path.data(), path.size(), x->token, x->weight,
+                                x->flags);
+
+                        path.push_back(x->token);
+                        mergeEdges(from, path);
+                        path.pop_back();
+                }
+        }
+
+        void readEdges(istream& is, vector<uint32_t>& path, size_t size)
+        {
+                for (size_t i = 0; i < size && is.good(); ++i) {
+                        string key, w;
+                        uint32_t weight = 0;
+                        is >> key >> w >> weight;
+
+                        size_t numChars = 0;
+                        is >> numChars;
+                        uint32_t flags = 0;
+                        for (size_t j = 0; j < numChars; ++j) {
+                                string c;
+                                is >> c;
+                                flags |= characteristicFromString(c);
+                        }
+
+                        uint32_t tok = symbols().intern(key);
+                        add(path.data(), path.size(), tok, weight, flags);
+
+                        size_t numChildren = 0;
+                        is >> numChildren;
+                        if (numChildren > 0) {
+                                path.push_back(tok);
+                                readEdges(is, path, numChildren);
+                                path.pop_back();
+                        }
+                }
+        }
+};
+
+/*
+ * Two copies of a model, so generating never waits for training (the
+ * left-right scheme). Generators read whichever copy is published. The
+ * trainer changes the other copy, publishes it, waits for the last readers
+ * of the old one to leave and makes the same change there. Changes have to
+ * be deterministic for the copies to stay the same. The price is twice the
+ * memory, and every change is made twice.
+ *
+ * write() is called from one trainer thread, which may also read either
+ * copy between calls.
+ */
+struct ModelPair {
+        // A change, told whether it is the first of the two.
+        typedef function<void(Model&, bool)> Change;
+
+        ModelPair(unique_ptr<Model>& model) : copy_(model->clone())
+        {
+                models_[0] = &model;
+                models_[1] = &copy_;
+                readers_[0] = 0;
+                readers_[1] = 0;
+                model->prepare();
+                copy_->prepare();
+        }
+
+        void write(const Change& f)
+        {
+                int old = published_;
+                Model& next = *model(1 - old);
+                f(next, true);
+                next.prepare();
+
+                published_ = 1 - old;
+                while (readers_[old] > 0)
+                        this_thread::yield();
+
+                f(*model(old), false);
+                model(old)->prepare();
+        }
+
+        // The copy to read until leave(), it won't change meanwhile.
+        int enter()
+        {
+                for (;;) {
+                        int i = published_;
+                        ++readers_[i];
+                        if (published_ == i)
+                                return i;
+                        --readers_[i];
+                }
+        }
+
+        void leave(int i) { --readers_[i]; }
+
+        unique_ptr<Model>& model(int i) { return *models_[i]; }
+
+        unique_ptr<Model>* models_[2];
+        unique_ptr<Model> copy_;
+        atomic<int> published_{0};
+        atomic<int> readers_[2];
+};
+
+// Reads the published copy of a pair while in scope.
+struct ReadGuard {
+        ReadGuard(ModelPair& p) : pair_(p), copy_(p.enter()) {}
+        ~ReadGuard() { pair_.leave(copy_); }
+
+        unique_ptr<Model>& model() { return pair_.model(copy_); }
+
+        ModelPair& pair_;
+        int copy_;
+};
+
+#endif // MODEL_H
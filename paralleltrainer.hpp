@@ -0,0 +1,227 @@
+/*
+ *  Copyright (C) 2014 Philippe Groarke.
+ *  Author: Philippe Groarke <philippe.groarke@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+#ifndef PARALLELTRAINER_H
+#define PARALLELTRAINER_H
+
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "database.hpp"
+#include "model.hpp"
+#include "reader.hpp"
+#include "scan.hpp"
+#include "word.hpp"
+
+using namespace std;
+
+/*
+ * Trains a whole buffer on several threads, giving the same model as
+ * feeding it to Reader one word at a time.
+ *
+ * Each thread tokenizes a slice of the buffer against its own symbol
+ * table. The tables are then merged in slice order, so every token gets
+ * the id it would have had when read sequentially. Chains are counted in
+ * shards owned by their first token, each shard being a private model that
+ * only sees the positions of its own first words. The main model is then
+ * rebuilt from the shards, see Model::adopt().
+ */
+struct ParallelTrainer {
+        ParallelTrainer(int threads) : threads_(threads < 1 ? 1 : threads) {}
+
+        void train(Reader& reader, unique_ptr<Model>& model, int markovLength,
+                const string& modelType, const char* data, size_t size)
+        {
+                tokenize(data, size);
+                resolve(reader);
+                split();
+
+                // The shards start with what the model already knows.
+                model->prepare();
+                vector<unique_ptr<Model> > shards(threads_);
+                vector<thread> pool;
+                for (int s = 0; s < threads_; ++s) {
+                        shards[s] = makeModel(markovLength, modelType);
+                        pool.push_back(thread(&ParallelTrainer::count, this,
+                                ref(reader), cref(*model), ref(*shards[s]), s,
+                                markovLength));
+                }
+                for (auto& t : pool)
+                        t.join();
+
+                words_.clear();
+                words_.shrink_to_fit();
+                positions_.clear();
+
+                model = makeModel(markovLength, modelType);
+                model->adopt(shards);
+                reader.setModel(model, markovLength);
+        }
+
+        // Slices end on whitespace, so no token is cut in two.
+        void tokenize(const char* data, size_t size)
+        {
+                slices_.clear();
+                slices_.resize(threads_);
+                const char* begin = data;
+                const char* end = data + size;
+                for (int t = 0; t < threads_; ++t) {
+                        const char* e = t + 1 == threads_ ? end
+                                : data + size * (t + 1) / threads_;
+                        if (e < begin)
+                                e = begin;
+                        while (e != end && !isSpaceByte(*e))
+                                ++e;
+                        slices_[t].begin = begin;
+                        slices_[t].end = e;
+                        begin = e;
+                }
+
+                vector<thread> pool;
+                for (int t = 0; t < threads_; ++t)
+                        pool.push_back(thread(&ParallelTrainer::tokenizeSlice,
+                                this, ref(slices_[t])));
+                for (auto& x : pool)
+                        x.join();
+        }
+
+        /*
+         * Give local ids their global id, in slice order, then copy all the
+         * words into one array.
+         */
+        void resolve(Reader& reader)
+        {
+                size_t total = 0;
+                for (auto& x : slices_) {
+                        x.offset = total;
+                        total += x.ids.size();
+
+                        x.remap.resize(x.symbols.size());
+                        for (uint32_t id = 0; id < x.symbols.size(); ++id) {
+                                Word w;
+                                w.id_ = symbols().intern(x.symbols.str(id));
+                                reader.addCharacteristics(w);
+                                x.remap[id] = w;
+                        }
+                }
+
+                words_.resize(total);
+                vector<thread> pool;
+                for (int t = 0; t < threads_; ++t) {
+                        pool.push_back(thread([this](Slice& x) {
+                                for (size_t i = 0; i < x.ids.size(); ++i)
+                                        words_[x.offset + i] = x.remap[x.ids[i]];
+                                x = Slice();
+                        }, ref(slices_[t])));
+                }
+                for (auto& x : pool)
+                        x.join();
+        }
+
+        /*
+         * Where each shard's first words are, one list per shard and per
+         * part of words_. Every thread sorts one part.
+         */
+        void split()
+        {
+                positions_.assign(threads_, vector<vector<size_t> >(threads_));
+                vector<thread> pool;
+                for (int t = 0; t < threads_; ++t) {
+                        pool.push_back(thread([this, t]() {
+                                size_t b = words_.size() * t / threads_;
+                                size_t e = words_.size() * (t + 1) / threads_;
+                                for (size_t i = b; i < e; ++i)
+                                        positions_[t][owner(words_[i].id_)].push_back(i);
+                        }));
+                }
+                for (auto& x : pool)
+                        x.join();
+        }
+
+        // Same windows as Reader::addWord() and generateMainTree().
+        void count(Reader& reader, const Model& model, Model& shard, int s,
+                int markovLength)
+        {
+                const Edge* b = nullptr;
+                const Edge* e = nullptr;
+                if (model.successors(nullptr, 0, b, e)) {
+                        for (const Edge* x = b; x != e; ++x) {
+                                if (owner(x->token) == s)
+                                        shard.merge(model, *x);
+                        }
+                }
+
+                vector<const Word*> window;
+                for (int t = 0; t < threads_; ++t) {
+                        for (size_t i : positions_[t][s]) {
+                                window.clear();
+                                if (i + markovLength > words_.size()) {
+                                        window.push_back(&words_[i]);
+                                } else {
+                                        for (int j = 0; j < markovLength; ++j) {
+                                                window.push_back(&words_[i + j]);
+                                                if (j == 0 && reader.oneWordSentence(
+                                                                words_[i]))
+                                                        break;
+                                        }
+                                }
+                                shard.addChain(window);
+                        }
+                }
+        }
+
+        int owner(uint32_t token) const
+        {
+                return (uint64_t(token * 0x9E3779B1u) * threads_) >> 32;
+        }
+
+        struct Slice {
+                const char* begin = nullptr;
+                const char* end = nullptr;
+                Symbols symbols; // Local ids, in order of appearance.
+                vector<uint32_t> ids;
+                vector<Word> remap; // Local id to global word.
+                size_t offset = 0; // First word in words_.
+        };
+
+        void tokenizeSlice(Slice& x)
+        {
+                tokenize(x.begin, x.end, x.symbols, x.ids);
+        }
+
+        // Whitespace split into ids of a private table, safe on any thread.
+        static void tokenize(const char* p, const char* end, Symbols& table,
+                vector<uint32_t>& ids)
+        {
+                scanTokens(p, end - p, [&](const char* token, size_t n,
+                        uint8_t) {
+                        ids.push_back(table.intern(token, n));
+                });
+        }
+
+        int threads_;
+        vector<Slice> slices_;
+        vector<Word> words_;
+        // By part of words_ then by shard, positions of first words.
+        vector<vector<vector<size_t> > > positions_;
+};
+
+#endif // PARALLELTRAINER_H
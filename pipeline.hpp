@@ -0,0 +1,120 @@
+/*
+ *  Copyright (C) 2014 Philippe Groarke.
+ *  Author: Philippe Groarke <philippe.groarke@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gutenbergparser.hpp"
+#include "reader.hpp"
+#include "scan.hpp"
+#include "spscqueue.hpp"
+#include "word.hpp"
+
+using namespace std;
+
+// Bytes of cleaned text, and words, handed from one stage to the next.
+const size_t PIPELINE_TEXT_CHUNK = 1 << 16;
+const size_t PIPELINE_WORD_CHUNK = 1 << 12;
+const size_t PIPELINE_DEPTH = 16; // Chunks waiting between two stages.
+
+/*
+ * Gutenberg cleanup, tokenizing and learning on three threads. The stages
+ * pass chunks through bounded queues, so at most a few chunks are in
+ * flight whatever the size of the book. The tokenizer interns into its own
+ * table, the learning thread maps its ids to the process' ones like
+ * FilePool does, so symbols() is only touched by the thread that learns.
+ */
+struct GutenbergPipeline {
+        GutenbergPipeline() : text_(PIPELINE_DEPTH), words_(PIPELINE_DEPTH) {}
+
+        void run(istream& is, GutenbergParser& gp, Reader& reader)
+        {
+                thread parser(&GutenbergPipeline::parse, this, ref(is), ref(gp));
+                thread tokenizer(&GutenbergPipeline::tokenize, this);
+
+                // Tokenizer ids come in order, a new one is the next.
+                vector<uint32_t> remap;
+                vector<Word> words;
+                while (words_.pop(words)) {
+                        for (auto& x : words) {
+                                if (x.id_ == remap.size())
+                                        remap.push_back(symbols().intern(
+                                                symbols_.str(x.id_)));
+                                x.id_ = remap[x.id_];
+                                reader.addWord(x);
+                        }
+                }
+
+                parser.join();
+                tokenizer.join();
+        }
+
+        void parse(istream& is, GutenbergParser& gp)
+        {
+                string chunk;
+                gp.parse(is, [this, &chunk](const string& line) {
+                        chunk += line;
+                        chunk += ' ';
+                        if (chunk.size() >= PIPELINE_TEXT_CHUNK) {
+                                text_.push(move(chunk));
+                                chunk = string();
+                        }
+                });
+
+                if (!chunk.empty())
+                        text_.push(move(chunk));
+                text_.close();
+        }
+
+        // Chunks end on whole lines, no token is split between two.
+        void tokenize()
+        {
+                string chunk;
+                vector<Word> words;
+                while (text_.pop(chunk)) {
+                        scanTokens(chunk.data(), chunk.size(), [&](const char* token,
+                                size_t n, uint8_t flags) {
+                                Word w;
+                                w.id_ = symbols_.intern(token, n);
+                                w.characteristics_ = flags;
+                                words.push_back(w);
+
+                                if (words.size() >= PIPELINE_WORD_CHUNK) {
+                                        words_.push(move(words));
+                                        words = vector<Word>();
+                                }
+                        });
+                }
+
+                if (!words.empty())
+                        words_.push(move(words));
+                words_.close();
+        }
+
+        SpscQueue<string> text_;
+        SpscQueue<vector<Word> > words_;
+        Symbols symbols_; // The tokenizer's ids.
+};
+
+#endif // PIPELINE_H
@@ -21,36 +21,37 @@
 #define READSTDIN_H
 
 #include <iostream>
-#include <list>
 #include <string>
 #include <vector>
 
+#include "journal.hpp"
+#include "model.hpp"
+#include "scan.hpp"
+#include "sketch.hpp"
 #include "word.hpp"
 
 using namespace std;
 
+const size_t READ_BLOCK = 1 << 16;
+
 struct Reader {
 
         Reader() {}
 
-        bool isEndOfSentence(unique_ptr<Word>& w)
+        bool isEndOfSentence(const Word& w)
         {
-                if (w->word_.find(".") != string::npos ||
-                    w->word_.find("!") != string::npos ||
-                    w->word_.find("?") != string::npos)
-                        return true;
-                return false;
+                const string& s = w.str();
+                return tokenFlags(s.data(), s.size()) & CHARACTER_ENDL;
         }
 
-        void addCharacteristics(unique_ptr<Word>& w)
+        // Ends a sentence if it holds . ! or ?, starts one if capitalized.
+        void addCharacteristics(Word& w)
         {
-                if (isEndOfSentence(w)) {
-                        w->characteristics_.insert(CHARACTER_ENDL);
-                }
+                if (w.id_ == NPOS)
+                        return;
 
-                if (isupper(w->word_[0])) {
-                        w->characteristics_.insert(CHARACTER_BEGIN);
-                }
+                const string& s = w.str();
+                w.characteristics_ |= tokenFlags(s.data(), s.size());
         }
 
         friend istream& operator>>(istream& is, Reader& r) {
@@ -58,98 +59,141 @@ struct Reader {
 
                 // Get input.
                 while (is >> userText) {
-                        r.hugeAssWordList_.push_back(unique_ptr<Word>(new Word(userText)));
-                        r.addCharacteristics(r.hugeAssWordList_.back());
+                        Word w(userText);
+                        r.addCharacteristics(w);
+                        r.addWord(w);
                 }
 
                 return is;
         }
 
-        void addToHugeAssWordList(unique_ptr<Word> w)
+        /*
+         * Split a buffer on whitespace like operator>> does, interning every
+         * token straight from the buffer. Nothing is copied, characteristics
+         * come out of the same scan.
+         */
+        void read(const char* data, size_t size)
         {
-                hugeAssWordList_.push_back(move(w));
+                scanTokens(data, size, [this](const char* token, size_t n,
+                        uint8_t flags) {
+                        Word w;
+                        w.id_ = symbols().intern(token, n);
+                        w.characteristics_ = flags;
+                        addWord(w);
+                });
         }
 
-        void addToHugeAssWordList(unique_ptr<vector<unique_ptr<Word> > > v)
+        // read() for a stream, a block at a time.
+        void read(istream& is)
         {
-                for (auto& x : *v) {
-                        hugeAssWordList_.push_back(move(x));
+                vector<char> block(READ_BLOCK);
+                size_t size = 0;
+                while (is.read(block.data() + size, block.size() - size)
+                                || is.gcount() > 0) {
+                        size += is.gcount();
+
+                        // A token cut by the end of the block waits for the rest.
+                        size_t end = size;
+                        if (is) {
+                                while (end > 0 && !isSpaceByte(block[end - 1]))
+                                        --end;
+                                if (end == 0) {
+                                        block.resize(block.size() * 2);
+                                        continue;
+                                }
+                        }
+
+                        read(block.data(), end);
+                        copy(block.begin() + end, block.begin() + size,
+                                block.begin());
+                        size -= end;
                 }
+                read(block.data(), size);
         }
 
-        bool oneWordSentence(unique_ptr<Word>& w)
+        void addWords(unique_ptr<vector<Word> > v)
         {
-                if (w->characteristics_.find(CHARACTER_BEGIN) !=
-                        w->characteristics_.end()
-                        && w->characteristics_.find(CHARACTER_ENDL) !=
-                        w->characteristics_.end())
+                for (const auto& x : *v)
+                        addWord(x);
+        }
+
+        bool oneWordSentence(const Word& w)
+        {
+                const uint8_t both = CHARACTER_BEGIN | CHARACTER_ENDL;
+                if ((w.characteristics_ & both) == both)
                         return true;
 
                 return false;
         }
 
-        void generateMainTree(unique_ptr<map<string, unique_ptr<Word> > >& myMap, int markovLength)
+        // Where words go from now on. Set before feeding any.
+        void setModel(unique_ptr<Model>& model, int markovLength)
         {
-                int currentRead = 0;
-                for (auto x = hugeAssWordList_.begin(); x != hugeAssWordList_.end();) {
-                        list<unique_ptr<Word> > temp;
-
-                        // Still add words.
-                        if (currentRead + markovLength > hugeAssWordList_.size()) {
-                                temp.push_back(move(*x));
-                        } else {
-                                // Create a temporary list of n words (n == markov chain length)
-                                auto y = x;
-                                for (int i = 0; i < markovLength; ++i) {
-                                        if (i == 0) {
-                                                temp.push_back(move(*x));
-                                                // Dont conitnue if it is a 1 sentence sentence.
-                                                        if (oneWordSentence(temp.back()))
-                                                                break;
-                                                ++y;
-                                        } else {
-                                                temp.push_back(unique_ptr<Word>(new Word(**y)));
-                                                ++y;
-                                        }
-                                }
-                        }
-
-
-                        // Get the first word.
-                        unique_ptr<Word> wt = move(temp.front());
-                        temp.pop_front();
-
-                        // Copy characterisics or else segfault.
-                        unordered_set<string> tempChars = wt->characteristics_;
-
-                        auto ret = myMap->insert(
-                                pair<string, unique_ptr<Word> >(wt->word_, move(wt)));
-
-                        // If the word is allready in the main map, add weight
-                        // and all characteristics.
-                        if (ret.second == false) {
-                                ret.first->second->weight_++;
-                                for (auto& x : tempChars) {
-                                        ret.first->second->characteristics_.insert(x);
-                                }
-                        }
-
-                        ret.first->second->addWordInChain(temp);
+                model_ = model.get();
+                ring_.assign(markovLength, Word());
+                head_ = 0;
+                count_ = 0;
+        }
 
-                        ++currentRead;
-                        ++x;
+        /*
+         * Train as words arrive. Only the last markovLength words are kept,
+         * the chain starting at the oldest one is learned once it is whole.
+         */
+        void addWord(const Word& w)
+        {
+                ring_[(head_ + count_) % ring_.size()] = w;
+                if (++count_ < ring_.size())
+                        return;
+
+                window_.clear();
+                for (size_t i = 0; i < count_; ++i) {
+                        window_.push_back(&ring_[(head_ + i) % ring_.size()]);
+                        // Dont conitnue if it is a 1 sentence sentence.
+                        if (i == 0 && oneWordSentence(ring_[head_]))
+                                break;
                 }
+                learn();
+                pop();
+        }
 
-                if (hugeAssWordList_.size() > 0)
-                        hugeAssWordList_.erase( hugeAssWordList_.begin(),
-                                hugeAssWordList_.end());
+        // End of input, the words left can't start a whole chain.
+        void generateMainTree()
+        {
+                while (count_ > 0) {
+                        window_.clear();
+                        window_.push_back(&ring_[head_]);
+                        learn();
+                        pop();
+                }
 
                 // Debug output of root tree.
-                //for (auto& x : *myMap)
-                //         x.second->printInfo();
+                //model_->printInfo();
+        }
+
+        Model* model_ = nullptr;
+        Journal* journal_ = nullptr; // Exact chains are also written here.
+        vector<Word> ring_; // Last markovLength words.
+        size_t head_ = 0;
+        size_t count_ = 0;
+        vector<const Word*> window_;
+        unique_ptr<ApproxTrainer> approx_; // Memory bounded training if set.
 
+private:
+        void learn()
+        {
+                if (approx_)
+                        approx_->addChain(*model_, window_);
+                else
+                        model_->addChain(window_);
+
+                if (journal_ != nullptr && !approx_)
+                        journal_->addChain(window_);
         }
 
-        list<unique_ptr<Word> > hugeAssWordList_;
+        void pop()
+        {
+                head_ = (head_ + 1) % ring_.size();
+                --count_;
+        }
 };
 #endif //READSTDIN_H
@@ -0,0 +1,211 @@
+/*
+ *  Copyright (C) 2014 Philippe Groarke.
+ *  Author: Philippe Groarke <philippe.groarke@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_AVX2
+#include <immintrin.h>
+#endif
+
+#include "word.hpp"
+
+using namespace std;
+
+/*
+ * Tokenizing kernels. A buffer is classified 64 bytes at a time into bit
+ * masks, whitespace and sentence terminators. On x86 the AVX2 kernels are
+ * picked at run time when the processor has them, otherwise SSE2 when the
+ * compiler targets it and plain loops elsewhere. Tokens and their
+ * characteristics then come out of the masks without looking at the bytes
+ * again. Whitespace is what isspace() accepts in the C locale.
+ */
+
+inline bool isSpaceByte(char c)
+{
+        return c == ' ' || (unsigned char)(c - '\t') <= '\r' - '\t';
+}
+
+inline bool isTerminatorByte(char c)
+{
+        return c == '.' || c == '!' || c == '?';
+}
+
+inline bool isUpperByte(char c)
+{
+        return (unsigned char)(c - 'A') <= 'Z' - 'A';
+}
+
+// Same as Reader::addCharacteristics(), for one token.
+inline uint8_t tokenFlags(const char* s, size_t n)
+{
+        uint8_t ret = 0;
+        for (size_t i = 0; i < n; ++i) {
+                if (isTerminatorByte(s[i])) {
+                        ret |= CHARACTER_ENDL;
+                        break;
+                }
+        }
+        if (n > 0 && isUpperByte(s[0]))
+                ret |= CHARACTER_BEGIN;
+        return ret;
+}
+
+#if defined(SCAN_AVX2)
+// Checked once, the kernels below can't run on older processors.
+inline bool hasAvx2()
+{
+        static const bool ret = __builtin_cpu_supports("avx2");
+        return ret;
+}
+
+__attribute__((target("avx2")))
+inline void classify64Avx2(const char* p, uint64_t& space, uint64_t& term)
+{
+        for (int i = 0; i < 64; i += 32) {
+                __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+                __m256i c = _mm256_sub_epi8(v, _mm256_set1_epi8('\t'));
+                __m256i ctrl = _mm256_cmpeq_epi8(_mm256_min_epu8(c,
+                        _mm256_set1_epi8('\r' - '\t')), c);
+                __m256i s = _mm256_or_si256(ctrl,
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+                __m256i t = _mm256_or_si256(_mm256_or_si256(
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('.')),
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('!'))),
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('?')));
+                space |= uint64_t(uint32_t(_mm256_movemask_epi8(s))) << i;
+                term |= uint64_t(uint32_t(_mm256_movemask_epi8(t))) << i;
+        }
+}
+#endif
+
+#if defined(__SSE2__)
+inline void classify16(const char* p, uint32_t& space, uint32_t& term)
+{
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        __m128i c = _mm_sub_epi8(v, _mm_set1_epi8('\t'));
+        __m128i ctrl = _mm_cmpeq_epi8(_mm_min_epu8(c,
+                _mm_set1_epi8('\r' - '\t')), c);
+        __m128i s = _mm_or_si128(ctrl, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+        __m128i t = _mm_or_si128(_mm_or_si128(
+                _mm_cmpeq_epi8(v, _mm_set1_epi8('.')),
+                _mm_cmpeq_epi8(v, _mm_set1_epi8('!'))),
+                _mm_cmpeq_epi8(v, _mm_set1_epi8('?')));
+        space = _mm_movemask_epi8(s);
+        term = _mm_movemask_epi8(t);
+}
+#endif
+
+// Bit i of the masks is byte i of p. Bytes past n count as whitespace.
+inline void classify64(const char* p, size_t n, uint64_t& space,
+        uint64_t& term)
+{
+        space = 0;
+        term = 0;
+        if (n >= 64) {
+#if defined(SCAN_AVX2)
+                if (hasAvx2()) {
+                        classify64Avx2(p, space, term);
+                        return;
+                }
+#endif
+#if defined(__SSE2__)
+                for (int i = 0; i < 64; i += 16) {
+                        uint32_t s = 0;
+                        uint32_t t = 0;
+                        classify16(p + i, s, t);
+                        space |= uint64_t(s) << i;
+                        term |= uint64_t(t) << i;
+                }
+                return;
+#endif
+        }
+
+        for (size_t i = 0; i < 64; ++i) {
+                if (i >= n || isSpaceByte(p[i]))
+                        space |= uint64_t(1) << i;
+                else if (isTerminatorByte(p[i]))
+                        term |= uint64_t(1) << i;
+        }
+}
+
+/*
+ * Calls f(token, size, flags) for every whitespace separated token, flags
+ * being the characteristics tokenFlags() would give it.
+ */
+template <class F>
+void scanTokens(const char* data, size_t size, F f)
+{
+        const char* token = nullptr;
+        bool ends = false;
+
+        for (size_t block = 0; block < size; block += 64) {
+                uint64_t space = 0;
+                uint64_t term = 0;
+                classify64(data + block, size - block, space, term);
+
+                int pos = 0;
+                while (true) {
+                        uint64_t from = ~uint64_t(0) << pos;
+                        if (token == nullptr) {
+                                uint64_t starts = ~space & from;
+                                if (starts == 0)
+                                        break;
+
+                                pos = __builtin_ctzll(starts);
+                                from = ~uint64_t(0) << pos;
+                                token = data + block + pos;
+                                ends = false;
+                        }
+
+                        uint64_t stops = space & from;
+                        if (stops == 0) {
+                                ends = ends || (term & from) != 0;
+                                break;
+                        }
+
+                        int stop = __builtin_ctzll(stops);
+                        uint64_t inside = from & ((uint64_t(1) << stop) - 1);
+                        ends = ends || (term & inside) != 0;
+
+                        const char* end = data + block + stop;
+                        uint8_t flags = ends ? CHARACTER_ENDL : 0;
+                        if (isUpperByte(*token))
+                                flags |= CHARACTER_BEGIN;
+                        f(token, end - token, flags);
+
+                        token = nullptr;
+                        pos = stop;
+                }
+        }
+
+        // The last token ran up to the end of a full block.
+        if (token != nullptr) {
+                uint8_t flags = ends ? CHARACTER_ENDL : 0;
+                if (isUpperByte(*token))
+                        flags |= CHARACTER_BEGIN;
+                f(token, data + size - token, flags);
+        }
+}
+
+#endif // SCAN_H
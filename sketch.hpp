@@ -0,0 +1,161 @@
+/*
+ *  Copyright (C) 2014 Philippe Groarke.
+ *  Author: Philippe Groarke <philippe.groarke@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "model.hpp"
+#include "word.hpp"
+
+using namespace std;
+
+// An n-gram needs this many sightings before it goes in the model.
+const uint32_t APPROX_MIN_COUNT = 2;
+// Most successors kept per context, the first words aside.
+const size_t APPROX_TOP_K = 64;
+
+/*
+ * Count-min sketch with conservative update. Counts never go under the real
+ * value and only go over it on hash collisions.
+ */
+struct CountMinSketch {
+        CountMinSketch(size_t bytes, int depth = 4) : depth_(depth), width_(1024)
+        {
+                while (width_ * 2 * depth_ * sizeof(uint32_t) <= bytes)
+                        width_ *= 2;
+                counters_.assign(width_ * depth_, 0);
+        }
+
+        // Count one more and return the new estimate.
+        uint32_t add(uint64_t key)
+        {
+                uint32_t estimate = UINT32_MAX;
+                for (int d = 0; d < depth_; ++d)
+                        estimate = min(estimate, counters_[index(d, key)]);
+
+                if (estimate == UINT32_MAX)
+                        return estimate;
+
+                for (int d = 0; d < depth_; ++d) {
+                        uint32_t& c = counters_[index(d, key)];
+                        if (c == estimate)
+                                ++c;
+                }
+                return estimate + 1;
+        }
+
+        size_t index(int d, uint64_t key) const
+        {
+                key ^= (d + 1) * 0x9E3779B97F4A7C15ULL;
+                key ^= key >> 33;
+                key *= 0xFF51AFD7ED558CCDULL;
+                key ^= key >> 33;
+                return d * width_ + (key & (width_ - 1));
+        }
+
+        int depth_;
+        size_t width_; // Power of 2.
+        vector<uint32_t> counters_;
+};
+
+/*
+ * Memory bounded training. Every n-gram is counted in the sketch, and it
+ * only goes in the model once it was seen APPROX_MIN_COUNT times and its
+ * context has room among its top successors. A full context makes room by
+ * dropping its weakest successor if the new one was seen more often. Once
+ * in, an n-gram is counted exactly.
+ *
+ * The model and the symbols share the rest of the budget. Once they reach
+ * it, nothing new gets in and new tokens aren't interned anymore. Rare
+ * n-grams are lost, the common ones keep their counts.
+ */
+struct ApproxTrainer {
+        ApproxTrainer(size_t bytes) :
+                sketch_(bytes / 4),
+                budget_(bytes - bytes / 4)
+        {
+                symbols().limit_ = budget_;
+        }
+
+        ~ApproxTrainer() { symbols().limit_ = numeric_limits<size_t>::max(); }
+
+        void addChain(Model& model, const vector<const Word*>& window)
+        {
+                context_.clear();
+                uint64_t key = 14695981039346656037ULL;
+
+                for (size_t i = 0; i < window.size(); ++i) {
+                        uint32_t tok = window[i]->id_;
+                        if (tok == NPOS)
+                                return; // Past the symbols budget.
+
+                        key = (key ^ tok) * 1099511628211ULL;
+                        uint32_t estimate = sketch_.add(key);
+
+                        if (model.weight(context_.data(), i, tok) > 0) {
+                                model.add(context_.data(), i, tok, 1,
+                                        window[i]->characteristics_);
+                        } else if (estimate >= APPROX_MIN_COUNT
+                        && model.memory() + symbols().memory() < budget_
+                        && makeRoom(model, i, estimate)) {
+                                model.add(context_.data(), i, tok, estimate,
+                                        window[i]->characteristics_);
+                        } else {
+                                // Longer n-grams need this one first.
+                                return;
+                        }
+
+                        context_.push_back(tok);
+                }
+        }
+
+        /*
+         * Whether the context has room for a successor seen estimate times.
+         * A full one drops its weakest successor if that was seen less.
+         */
+        bool makeRoom(Model& model, size_t n, uint32_t estimate)
+        {
+                if (n == 0 || model.numSuccessors(context_.data(), n) < APPROX_TOP_K)
+                        return true;
+
+                const Edge* b = nullptr;
+                const Edge* e = nullptr;
+                model.successors(context_.data(), n, b, e);
+                const Edge* weakest = min_element(b, e, [](const Edge& x,
+                        const Edge& y) -> bool {
+                        return x.weight < y.weight;
+                });
+                if (weakest == e || weakest->weight >= estimate)
+                        return false;
+
+                model.remove(context_.data(), n, weakest->token);
+                return true;
+        }
+
+        CountMinSketch sketch_;
+        size_t budget_;
+        vector<uint32_t> context_;
+};
+
+#endif // SKETCH_H
@@ -0,0 +1,89 @@
+/*
+ *  Copyright (C) 2014 Philippe Groarke.
+ *  Author: Philippe Groarke <philippe.groarke@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#include <atomic>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+/*
+ * Bounded lock-free queue between one producer and one consumer thread.
+ * push() waits while the queue is full, which holds a fast stage back to
+ * the pace of a slow one.
+ */
+template <class T>
+struct SpscQueue {
+        SpscQueue(size_t capacity) : slots_(capacity + 1) {}
+
+        // False if the consumer gave up, x is dropped.
+        bool push(T x)
+        {
+                size_t tail = tail_.load(memory_order_relaxed);
+                size_t next = (tail + 1) % slots_.size();
+                while (next == head_.load(memory_order_acquire)) {
+                        if (abandoned_.load(memory_order_acquire))
+                                return false;
+                        this_thread::yield();
+                }
+
+                slots_[tail] = move(x);
+                tail_.store(next, memory_order_release);
+                return true;
+        }
+
+        // Waits while empty. False once closed and drained.
+        bool pop(T& x)
+        {
+                size_t head = head_.load(memory_order_relaxed);
+                while (head == tail_.load(memory_order_acquire)) {
+                        if (closed_.load(memory_order_acquire)
+                                        && head == tail_.load(memory_order_acquire))
+                                return false;
+                        this_thread::yield();
+                }
+
+                x = move(slots_[head]);
+                head_.store((head + 1) % slots_.size(), memory_order_release);
+                return true;
+        }
+
+        // No more pushes.
+        void close() { closed_.store(true, memory_order_release); }
+
+        // No more pops, a waiting producer stops waiting.
+        void abandon() { abandoned_.store(true, memory_order_release); }
+
+        vector<T> slots_;
+
+        // Each on its own cache line, producer and consumer don't share.
+        char pad0_[64];
+        atomic<size_t> head_{0};
+        char pad1_[64];
+        atomic<size_t> tail_{0};
+        char pad2_[64];
+        atomic<bool> closed_{false};
+        atomic<bool> abandoned_{false};
+};
+
+#endif // SPSCQUEUE_H
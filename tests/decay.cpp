@@ -0,0 +1,127 @@
+/*
+ *  Copyright (C) 2014 Philippe Groarke.
+ *  Author: Philippe Groarke <philippe.groarke@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+/*
+ * Decay has to forget at the rate asked for, counts of 1 included. Every
+ * backend gets DECAY_EDGES first words of weight 1 and one decay.
+ */
+
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+
+#include "../hashmodel.hpp"
+#include "../markovmodel.hpp"
+#include "../triemodel.hpp"
+
+using namespace std;
+
+const uint32_t DECAY_EDGES = 10000;
+
+size_t survivors(Model& model, float factor)
+{
+        for (uint32_t i = 0; i < DECAY_EDGES; ++i)
+                model.add(nullptr, 0, i, 1, 0);
+        model.decay(factor, 1, DECAY_EDGES);
+        return model.size();
+}
+
+// Within 5% of the expected count.
+bool near(size_t got, double expected)
+{
+        return abs(double(got) - expected) <= expected * 0.05;
+}
+
+int check(const string& name, Model& (*make)())
+{
+        int failed = 0;
+        const float factors[] = {0.99f, 0.9f, 0.5f};
+        for (float f : factors) {
+                size_t got = survivors(make(), f);
+                if (!near(got, DECAY_EDGES * f)) {
+                        cout << name << ": " << got << " of " << DECAY_EDGES
+                                << " weight 1 edges left after a decay of "
+                                << f << endl;
+                        ++failed;
+                }
+        }
+        return failed;
+}
+
+/*
+ * A context the sweep hasn't reached learns after three decays with no
+ * work, its new counts must only decay from then on.
+ */
+int late(const string& name, Model& model)
+{
+        uint32_t a = 1;
+        model.add(nullptr, 0, a, 100, 0);
+        model.add(&a, 1, 2, 100, 0);
+        for (int i = 0; i < 3; ++i)
+                model.decay(0.5f, 1, 0);
+        model.add(&a, 1, 2, 100, 0);
+        model.decay(0.5f, 1, DECAY_EDGES);
+
+        // 100 * 0.5^4 from before, 100 * 0.5 since.
+        uint32_t got = model.weight(&a, 1, 2);
+        if (near(got, 56.25))
+                return 0;
+        cout << name << ": weight " << got << " learned during a sweep, "
+                << "56 expected" << endl;
+        return 1;
+}
+
+unique_ptr<Model> model_;
+
+template <class M, int O>
+Model& make()
+{
+        model_.reset(new M(O));
+        return *model_;
+}
+
+Model& makeMarkov()
+{
+        model_.reset(new MarkovModel<3>());
+        return *model_;
+}
+
+int main()
+{
+        int failed = check("tree", make<TrieModel, 3>)
+                + check("hash", make<HashModel, 3>)
+                + check("markov", makeMarkov);
+        failed += late("tree", make<TrieModel, 3>())
+                + late("hash", make<HashModel, 3>())
+                + late("markov", makeMarkov());
+
+        // A lone edge of weight 1 outlives a decay of 0.99. Rounding hashes
+        // the edge, so this holds on every run.
+        TrieModel one(3);
+        one.add(nullptr, 0, 7, 1, 0);
+        one.decay(0.99f, 1, 1);
+        if (one.weight(nullptr, 0, 7) != 1) {
+                cout << "tree: weight 1 edge lost after a decay of 0.99" << endl;
+                ++failed;
+        }
+
+        if (failed == 0)
+                cout << "decay ok" << endl;
+        return failed == 0 ? 0 : 1;
+}
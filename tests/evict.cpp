@@ -0,0 +1,79 @@
+/*
+ *  Copyright (C) 2014 Philippe Groarke.
+ *  Author: Philippe Groarke <philippe.groarke@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+/*
+ * Removing a successor takes every longer context through it along, so
+ * an eviction gives its memory back and old counts don't come back when
+ * the token is learned again.
+ */
+
+#include <iostream>
+#include <memory>
+
+#include "../hashmodel.hpp"
+#include "../markovmodel.hpp"
+#include "../triemodel.hpp"
+
+using namespace std;
+
+const uint32_t EVICT_EDGES = 1000;
+
+int check(const string& name, Model& model)
+{
+        // Context a b, with many successors.
+        uint32_t path[] = {1, 2};
+        model.add(nullptr, 0, path[0], 10, 0);
+        model.add(path, 1, path[1], 10, 0);
+        for (uint32_t i = 0; i < EVICT_EDGES; ++i)
+                model.add(path, 2, 100 + i, 1, 0);
+        model.prepare();
+
+        size_t before = model.memory();
+        model.remove(path, 1, path[1]);
+        model.prepare();
+
+        int failed = 0;
+        if (model.memory() >= before) {
+                cout << name << ": " << model.memory() << " bytes after an "
+                        << "eviction, " << before << " before" << endl;
+                ++failed;
+        }
+
+        model.add(path, 1, path[1], 1, 0);
+        if (model.numSuccessors(path, 2) != 0) {
+                cout << name << ": " << model.numSuccessors(path, 2)
+                        << " successors came back with the evicted token"
+                        << endl;
+                ++failed;
+        }
+        return failed;
+}
+
+int main()
+{
+        TrieModel tree(3);
+        HashModel hash(3);
+        MarkovModel<3> markov;
+        int failed = check("tree", tree) + check("hash", hash)
+                + check("markov", markov);
+
+        if (failed == 0)
+                cout << "evict ok" << endl;
+        return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,223 @@
+/*
+ *  Copyright (C) 2014 Philippe Groarke.
+ *  Author: Philippe Groarke <philippe.groarke@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+#ifndef TRIEMODEL_H
+#define TRIEMODEL_H
+
+#include <algorithm>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include "model.hpp"
+#include "word.hpp"
+
+using namespace std;
+
+/*
+ * The n-gram tree, for any Markov length. Node 0 is the root, its edges are
+ * the first words and every edge links to the node of its own successors.
+ */
+struct TrieModel : public Model {
+        TrieModel(int order) : order_(order) { store_.newNode(); }
+
+        int order() const { return order_; }
+
+        void addChain(const vector<const Word*>& window)
+        {
+                uint32_t node = 0;
+                for (size_t i = 0; i < window.size(); ++i) {
+                        decayNode(node, decayFactor_, decayThreshold_);
+                        uint32_t e = store_.addEdge(node, window[i]->id_, 1,
+                                window[i]->characteristics_);
+                        if (i + 1 < window.size())
+                                node = childOf(e);
+                }
+        }
+
+        void add(const uint32_t* context, size_t n, uint32_t token,
+                uint32_t weight, uint32_t flags)
+        {
+                uint32_t node = 0;
+                for (size_t i = 0; i < n; ++i) {
+                        uint32_t e = store_.findEdge(node, context[i]);
+                        if (e == NPOS)
+                                e = store_.addEdge(node, context[i], 0, 0);
+                        node = childOf(e);
+                }
+                decayNode(node, decayFactor_, decayThreshold_);
+                store_.addEdge(node, token, weight, flags);
+        }
+
+        void remove(const uint32_t* context, size_t n, uint32_t token)
+        {
+                uint32_t node = find(context, n);
+                uint32_t e = node == NPOS ? NPOS : store_.findEdge(node, token);
+                if (e == NPOS)
+                        return;
+
+                if (store_.edge(e).child != NPOS)
+                        freeSubtree(store_.edge(e).child);
+                store_.removeEdge(node, e);
+        }
+
+        bool successors(const uint32_t* context, size_t n,
+                const Edge*& begin, const Edge*& end) const
+        {
+                uint32_t node = find(context, n);
+                if (node == NPOS)
+                        return false;
+
+                begin = store_.begin(node);
+                end = store_.end(node);
+                return true;
+        }
+
+        const Edge* sample(const uint32_t* context, size_t n, mt19937& gen)
+        {
+                uint32_t node = find(context, n);
+                if (node == NPOS)
+                        return nullptr;
+
+                uint32_t e = store_.sample(node, gen);
+                return e == NPOS ? nullptr : &store_.edge(e);
+        }
+
+        uint32_t weight(const uint32_t* context, size_t n, uint32_t token) const
+        {
+                uint32_t node = find(context, n);
+                if (node == NPOS)
+                        return 0;
+
+                uint32_t e = store_.findEdge(node, token);
+                return e == NPOS ? 0 : store_.edge(e).weight;
+        }
+
+        size_t numSuccessors(const uint32_t* context, size_t n) const
+        {
+                uint32_t node = find(context, n);
+                return node == NPOS ? 0 : store_.nodes_[node].size;
+        }
+
+        size_t memory() const { return store_.memory(); }
+
+        unique_ptr<Model> clone() const
+        {
+                return unique_ptr<Model>(new TrieModel(*this));
+        }
+
+        // Trees are copied whole and their roots become one.
+        void adopt(vector<unique_ptr<Model> >& from)
+        {
+                vector<EdgeStore*> stores;
+                for (auto& x : from) {
+                        TrieModel* t = dynamic_cast<TrieModel*>(x.get());
+                        if (t == nullptr || t->order_ != order_ || size() != 0)
+                                return Model::adopt(from);
+                        stores.push_back(&t->store_);
+                }
+
+                vector<uint32_t> at;
+                store_.append(stores, at);
+
+                vector<Edge> roots;
+                for (auto root : at) {
+                        roots.insert(roots.end(), store_.begin(root),
+                                store_.end(root));
+                        store_.freeNode(root);
+                }
+                sort(roots.begin(), roots.end(), [](const Edge& a,
+                        const Edge& b) -> bool {
+                        return a.token < b.token;
+                });
+                store_.assign(0, roots.data(), roots.data() + roots.size());
+                store_.prepare();
+        }
+
+        void reserve(size_t numEdges) { store_.reserve(numEdges); }
+
+        void prepare() { store_.prepare(); }
+
+        void decaySlice(float factor, uint32_t threshold, size_t work)
+        {
+                work = min(work, store_.nodes_.size());
+                for (; work > 0; --work) {
+                        if (cursor_ >= store_.nodes_.size())
+                                cursor_ = 0;
+
+                        decayNode(cursor_++, factor, threshold);
+                }
+        }
+
+        EdgeStore store_;
+        int order_;
+        uint32_t cursor_ = 0; // Next node to decay.
+
+private:
+        // Follow a path of tokens from the root, returns the node or NPOS.
+        uint32_t find(const uint32_t* path, size_t n) const
+        {
+                uint32_t node = 0;
+                for (size_t i = 0; i < n; ++i) {
+                        uint32_t e = store_.findEdge(node, path[i]);
+                        if (e == NPOS || store_.edge(e).child == NPOS)
+                                return NPOS;
+                        node = store_.edge(e).child;
+                }
+                return node;
+        }
+
+        uint32_t childOf(uint32_t e)
+        {
+                if (store_.edge(e).child == NPOS) {
+                        uint32_t node = store_.newNode(epoch_);
+                        store_.edge(e).child = node;
+                }
+                return store_.edge(e).child;
+        }
+
+        // Up to epoch_, a forgotten edge takes its whole subtree along.
+        void decayNode(uint32_t node, float factor, uint32_t threshold)
+        {
+                store_.decayNode(node, epoch_, factor, threshold,
+                        [this](const Edge& e) {
+                        if (e.child != NPOS)
+                                freeSubtree(e.child);
+                });
+        }
+
+        // A forgotten edge takes its whole subtree along.
+        void freeSubtree(uint32_t node)
+        {
+                stack_.push_back(node);
+                while (!stack_.empty()) {
+                        uint32_t n = stack_.back();
+                        stack_.pop_back();
+                        for (const Edge* x = store_.begin(n); x != store_.end(n); ++x) {
+                                if (x->child != NPOS)
+                                        stack_.push_back(x->child);
+                        }
+                        store_.freeNode(n);
+                }
+        }
+
+        vector<uint32_t> stack_;
+};
+
+#endif // TRIEMODEL_H
@@ -0,0 +1,70 @@
+/*
+ *  Copyright (C) 2014 Philippe Groarke.
+ *  Author: Philippe Groarke <philippe.groarke@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+#ifndef VARINT_H
+#define VARINT_H
+
+#include <cstdint>
+#include <iostream>
+#include <streambuf>
+
+using namespace std;
+
+/*
+ * Binary database: DSMC_MAGIC, then varints for the version, the Markov
+ * length and everything the model writes after them.
+ */
+const char DSMC_MAGIC[] = "DSMC";
+const uint32_t DSMC_VERSION = 3;
+// Contexts are compressed in blocks of about this many bytes.
+const size_t DSMC_BLOCK = 1 << 16;
+// Anything bigger in a binary database can only be damage.
+const uint64_t MAX_TOKEN_SIZE = 1 << 24;
+const uint64_t MAX_MARKOV_LENGTH = 255;
+const uint64_t MAX_BLOCK_SIZE = uint64_t(1) << 31;
+
+// 7 bits at a time, low bits first, the high bit says more follow.
+inline void writeVarint(streambuf* sb, uint64_t x)
+{
+        char buf[10];
+        int n = 0;
+        while (x >= 0x80) {
+                buf[n++] = char(x | 0x80);
+                x >>= 7;
+        }
+        buf[n++] = char(x);
+        sb->sputn(buf, n);
+}
+
+// False at the end of input or on a varint longer than 64 bits.
+inline bool readVarint(streambuf* sb, uint64_t& x)
+{
+        x = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+                int c = sb->sbumpc();
+                if (c == char_traits<char>::eof())
+                        return false;
+                x |= uint64_t(c & 0x7f) << shift;
+                if (!(c & 0x80))
+                        return true;
+        }
+        return false;
+}
+
+#endif // VARINT_H
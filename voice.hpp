@@ -24,7 +24,10 @@
 #include <memory>
 #include <random>
 
-#include "word.hpp"
+#include "model.hpp"
+
+// Sentences that don't fit the word limits are dropped after this many tries.
+const int MAX_SPEAK_TRIES = 100;
 
 struct Voice {
 
@@ -33,35 +36,37 @@ struct Voice {
                 mersenne_gen = mt19937(seed);
         }
 
-        void setRandom(int range, float rangePercent) {
+        void setRandom(int range) {
                 randomGen = uniform_int_distribution<int>(0, range);
-                randomPercent = rangePercent;
         }
 
         void setMarkov(int x) {
                 markovLength_ = x;
         }
 
-        void generateSortedVector(unique_ptr<map<string, unique_ptr<Word> > >& myMap)
+        // Only keeps positions of the root words, never copies the model.
+        void generateSortedVector(unique_ptr<Model>& myModel)
         {
-                if (sortedVector.size() > 0)
-                        sortedVector.erase(sortedVector.begin(), sortedVector.end());
+                model_ = myModel.get();
+                sortedVector.clear();
 
-                for (auto& x : *myMap) {
-                        unique_ptr<Word> temp(new Word(*x.second));
-                        sortedVector.push_back(move(temp));
-                }
+                const Edge* roots = nullptr;
+                const Edge* end = nullptr;
+                if (!model_->successors(nullptr, 0, roots, end))
+                        return;
 
-                sort(sortedVector.begin(), sortedVector.end(), [](unique_ptr<Word>& w1,
-                        unique_ptr<Word>& w2) -> bool {
-                        return w1->weight_ > w2->weight_;
+                for (uint32_t i = 0; i < end - roots; ++i)
+                        sortedVector.push_back(i);
+
+                sort(sortedVector.begin(), sortedVector.end(), [roots](uint32_t w1,
+                        uint32_t w2) -> bool {
+                        return roots[w1].weight > roots[w2].weight;
                 });
         }
 
         // Will output the position
-        vector<unique_ptr<Word> > findFirstWords() // Higher range is more random
+        const Edge* findFirstWord() // Higher range is more random
         {
-                static int lastRandomNumber = 0; // Don't repeat sentences.
                 int randomPos = -1;
 
                 if (randomGen.b() != 0) {
@@ -73,22 +78,48 @@ struct Voice {
                 }
                 lastRandomNumber = randomPos;
 
-                vector<unique_ptr<Word> > sentence;
+                const Edge* roots = nullptr;
+                const Edge* end = nullptr;
+                if (!model_->successors(nullptr, 0, roots, end))
+                        return nullptr;
 
-                for (int i = randomPos; i < sortedVector.size(); ++i) {
-                        // Loop around if at end
-                        if (i + 1 >= sortedVector.size())
-                                i = 0;
+                // Loop around once at most.
+                for (size_t n = 0; n < sortedVector.size(); ++n) {
+                        const Edge* x = roots
+                                + sortedVector[(randomPos + n) % sortedVector.size()];
 
                         // First word needs to start a sentence
-                        if (sortedVector[i]->characteristics_.find(CHARACTER_BEGIN)
-                        == sortedVector[i]->characteristics_.end())
-                                continue;
+                        if (x->flags & CHARACTER_BEGIN)
+                                return x;
+                }
+                return nullptr;
+        }
 
-                        sortedVector[i]->outputTopSentence(sentence, randomPercent);
-                        break;
+        /*
+         * One sentence as token ids. The returned vector is reused by the
+         * next call. Never longer than maxWords.
+         */
+        const vector<uint32_t>& generate(size_t maxWords)
+        {
+                sentence_.clear();
+
+                const Edge* x = findFirstWord();
+                while (x != nullptr) {
+                        sentence_.push_back(x->token);
+
+                        // Check if we have reached the end of a sentence.
+                        if ((x->flags & CHARACTER_ENDL) || sentence_.size() >= maxWords)
+                                break;
+
+                        // Follow the last n - 1 words, so we will get a
+                        // chain of 3 for example. Get a word AFTER them,
+                        // weighted by how often it followed.
+                        size_t contextSize = min<size_t>(sentence_.size(),
+                                markovLength_ - 1);
+                        x = model_->sample(sentence_.data() + sentence_.size()
+                                - contextSize, contextSize, mersenne_gen);
                 }
-                return sentence;
+                return sentence_;
         }
 
         vector<string> speak(int numSentences = 1,
@@ -97,57 +128,38 @@ struct Voice {
                 vector<string> ret;
 
                 for (int i = 0; i < numSentences; ++i) {
-
-                        string outputSentence;
-                        // Get a sentence beginning in 75% most used.
-                        vector<unique_ptr<Word> > sentence =
-                                findFirstWords();
-
-                        if (sentence.size() < 1)
-                            return ret;
-
-                        while (sentence.back()->characteristics_.find(CHARACTER_ENDL)
-                        == sentence.back()->characteristics_.end()) {
-                                // Get the word before the last one, so we will get a
-                                // chain of 2 for example.
-                                int beforeLast = sentence.size() - (markovLength_ - 1);
-
-                                string s = sentence[beforeLast]->word_;
-                                auto temp = find_if(sortedVector.begin(), sortedVector.end(),
-                                        [s](unique_ptr<Word>& w1) -> bool {
-                                                return w1->word_ == s;
-                                });
-
-                                // Now, get a top word AFTER the last word in sentence.
-                                // Ex: beforeLast->currentWord->newTopWord is what we
-                                // are doing.
-                                if (temp != sortedVector.end()) {
-                                        sentence.push_back((*temp)->getWord(
-                                                sentence.back())->topWord());
-                                } else { // Just make sure we are not at the complete end.
-                                        break;
-                                }
-                        }
-
-                        for (auto& x : sentence) {
-                                outputSentence += x->word_ + " ";
-                        }
-
-
                         // For twitch, make sentences smaller. Number of words.
-                        if (sentence.size() > maxWords || sentence.size() < minWords) {
-                                outputSentence = speak(1, minWords, maxWords).back();
+                        // Asking for one more word tells us when it is too long.
+                        for (int tries = 0; tries < MAX_SPEAK_TRIES; ++tries) {
+                                const vector<uint32_t>& sentence =
+                                        generate(maxWords + 1);
+
+                                if (sentence.size() < 1)
+                                        return ret;
+
+                                if (sentence.size() > size_t(maxWords)
+                                                || sentence.size() < size_t(minWords))
+                                        continue;
+
+                                string outputSentence;
+                                for (auto x : sentence) {
+                                        outputSentence += symbols().str(x);
+                                        outputSentence += " ";
+                                }
+                                ret.push_back(outputSentence);
+                                break;
                         }
-                        ret.push_back(outputSentence);
                 }
 
                 return ret;
         }
 
-        vector<unique_ptr<Word> > sortedVector;
+        Model* model_ = nullptr;
+        vector<uint32_t> sortedVector; // Root positions, heaviest first.
+        vector<uint32_t> sentence_;
         mt19937 mersenne_gen;
         uniform_int_distribution<int> randomGen;
         int markovLength_ = 3;
-        float randomPercent = 0.0;
+        int lastRandomNumber = 0; // Don't repeat sentences.
 };
 #endif //VOICE_H
@@ -21,209 +21,193 @@
 #define WORD_H
 
 #include <algorithm>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <limits>
 #include <list>
 #include <map>
 #include <math.h>
+#include <memory>
 #include <random>
+#include <string>
 #include <unordered_set>
 #include <vector>
 
 using namespace std;
 
-const string CHARACTER_ENDL = "END";
-const string CHARACTER_BEGIN = "START";
-const string CHARACTER_NAME = "NAME";
+const uint32_t NPOS = numeric_limits<uint32_t>::max();
 
-struct Word {
-        Word() : word_(""), weight_(1) {}
-        Word(const Word& obj) : word_(obj.word_), weight_(obj.weight_) {
-                for (auto& x : obj.chain_) {
-                        unique_ptr<Word> temp(new Word(*x.second));
-                        chain_.insert(pair<string, unique_ptr<Word> >(
-                                x.first, move(temp)));
-                }
-                for (auto x : obj.characteristics_) {
-                        characteristics_.insert(x);
-                }
-        }
-        Word(const string& txt) :
-                word_(txt), weight_(1) {}
-
-        // Will naturally stop at end of chain.
-        void outputTopSentence(vector<unique_ptr<Word> >& vec, float randomPercent = 0.0f) {
-                vec.push_back(unique_ptr<Word>(new Word(*this)));
+// Characteristics are a bit field, the strings are for the database text.
+const uint8_t CHARACTER_ENDL = 1 << 0;
+const uint8_t CHARACTER_BEGIN = 1 << 1;
+const uint8_t CHARACTER_NAME = 1 << 2;
+const char* const CHARACTER_STRINGS[] = {"END", "START", "NAME"};
+const int NUM_CHARACTERISTICS = 3;
 
-                unique_ptr<Word> topWord(new Word());
-                topWord->weight_ = 0;
-
-                if (chain_.size() <= 0)
-                        return;
-
-                float percentageToContinue = 0.0;
-
-                vector<unique_ptr<Word> > sortedVector;
-                for (auto& x : chain_) {
-                        percentageToContinue += x.second->weight_;
-                        unique_ptr<Word> temp(new Word(*x.second));
-                        sortedVector.push_back(move(temp));
-                }
-                sort(sortedVector.begin(), sortedVector.end(), [](unique_ptr<Word>& w1,
-                        unique_ptr<Word>& w2) -> bool {
-                        return w1->weight_ > w2->weight_;
-                });
-                percentageToContinue /= weight_;
-
-                // Pick a random word in the top x percent.
-                unsigned seed = chrono::system_clock::now().time_since_epoch().count();
-                //mersenne_gen = mt19937(seed);
-
-                int pickRange = randomPercent * chain_.size();
-                default_random_engine generator(seed);
-                uniform_int_distribution<int> distribution(0, pickRange);
-                int pos = distribution(generator);
-                topWord = move(sortedVector[pos]);
-
-                // If the current word starts and ends a sentence, moving to another word
-                // has to be at least used 25% of times.
-                // if (characteristics_.find(CHARACTER_ENDL) != characteristics_.end()) {
-                //         if (percentageToContinue > 0.25) {
-                //                 distribution = uniform_int_distribution<int>(0, 100);
-                //                 int luckyThrow = distribution(generator); // Maybe we get lucky?
-                //                 if (luckyThrow > 100 * randomPercent) // Nope!
-                //                         return; // We are a 1 word sentence, Kappa.
-                //         }
-                // }
-
-                // Check if we have reached the end of a sentence.
-                if (topWord->characteristics_.find(CHARACTER_ENDL)
-                != topWord->characteristics_.end()) {
-                        vec.push_back(move(topWord));
-                        return;
-                } else {
-                        topWord->outputTopSentence(vec);
-                }
+inline uint8_t characteristicFromString(const string& s)
+{
+        for (int i = 0; i < NUM_CHARACTERISTICS; ++i) {
+                if (s == CHARACTER_STRINGS[i])
+                        return 1 << i;
         }
+        return 0;
+}
+
+inline vector<string> characteristicsToStrings(uint8_t c)
+{
+        vector<string> ret;
+        for (int i = 0; i < NUM_CHARACTERISTICS; ++i) {
+                if (c & (1 << i))
+                        ret.push_back(CHARACTER_STRINGS[i]);
+        }
+        return ret;
+}
 
-        void addWordInChain(list<unique_ptr<Word> >& wl) {
-                if (wl.size() <= 0)
-                    return;
-
-                unordered_set<string> tempChar = wl.front()->characteristics_;
-
-                auto ret = chain_.insert(
-                        pair<string, unique_ptr<Word> >(
-                                wl.front()->word_, move(wl.front())));
-
-                if (ret.second == false) {
-                        ret.first->second->weight_++;
-                        // Add characteristics.
-                        for (auto& x : tempChar)
-                                ret.first->second->characteristics_.insert(x);
+/*
+ * Process wide token table. Every distinct token is stored once and known
+ * everywhere else by its 32 bit id. Lookups hash the raw bytes, so a token
+ * that is already known costs no allocation.
+ *
+ * Only one thread interns. Strings live in blocks that never move, so other
+ * threads may call str() on any id they got from a model while it grows.
+ *
+ * Once memory() reaches limit_, new tokens get NPOS instead of an id.
+ */
+struct Symbols {
+        Symbols() : table_(1024, NPOS) {}
+
+        uint32_t intern(const char* s, size_t n)
+        {
+                if ((size_ + 1) * 2 > table_.size())
+                        rehash(table_.size() * 2);
+
+                size_t mask = table_.size() - 1;
+                for (size_t i = hash(s, n) & mask;; i = (i + 1) & mask) {
+                        uint32_t id = table_[i];
+                        if (id == NPOS) {
+                                if (memory() >= limit_)
+                                        return NPOS;
+                                id = size_;
+                                bytes_ += n;
+                                at(id) = string(s, n);
+                                ++size_;
+                                table_[i] = id;
+                                return id;
+                        }
+                        if (equals(id, s, n))
+                                return id;
                 }
-                wl.pop_front();
-                ret.first->second->addWordInChain(wl);
         }
 
-        void printInfo(int indent = 0) {
-                for (int i = 0; i < indent; ++i)
-                        cout << "  ";
-
-                string charact;
-                for (const auto& x : characteristics_)
-                        charact += " (" + x + ")";
-
-                cout << "\"" << word_ << "\" " << weight_ << charact << endl;
+        uint32_t intern(const string& s) { return intern(s.data(), s.size()); }
 
-                for (auto& x : chain_) {
-                        x.second->printInfo(indent + 1);
+        // Id of a token, or NPOS if it was never seen.
+        uint32_t find(const char* s, size_t n) const
+        {
+                size_t mask = table_.size() - 1;
+                for (size_t i = hash(s, n) & mask;; i = (i + 1) & mask) {
+                        uint32_t id = table_[i];
+                        if (id == NPOS || equals(id, s, n))
+                                return id;
                 }
         }
 
-        unique_ptr<Word>& getWord(const string& key) {
-                return chain_.at(key);
+        const string& str(uint32_t id) const
+        {
+                size_t offset = 0;
+                int b = block(id, offset);
+                return blocks_[b][offset];
         }
 
-        unique_ptr<Word>& getWord(unique_ptr<Word>& key) {
-                return chain_.at(key->word_);
-        }
-
-        unique_ptr<Word> topWord() {
-                vector<unique_ptr<Word> > sortedByWeight;
-                for (auto& x : chain_) {
-                        unique_ptr<Word> temp(new Word(*x.second));
-                        sortedByWeight.push_back(move(temp));
-                }
-
-                sort(sortedByWeight.begin(), sortedByWeight.end(), [](unique_ptr<Word>& w1,
-                        unique_ptr<Word>& w2) -> bool {
-                        return w1->weight_ > w2->weight_;
-                });
-
-                unique_ptr<Word> topWord(new Word());
-                topWord->weight_ = 0;
+        size_t size() const { return size_; }
 
-                if (chain_.size() <= 0) {
-                        return topWord;
-                }
+        // Bytes held, strings counted by their length.
+        size_t memory() const
+        {
+                return bytes_ + table_.capacity() * sizeof(uint32_t);
+        }
 
-                srand (time(NULL));
-                int top = rand() % 10;
-                if (sortedByWeight.size()-1 < top) {
-                        //cout << "Chain not long enough, size: " << chain_.size() << endl;
-                        srand (time(NULL));
-                        top = rand() % sortedByWeight.size();
-                        //cout << "New random number: " << top << endl;
+        static size_t hash(const char* s, size_t n)
+        {
+                // FNV-1a
+                uint64_t h = 14695981039346656037ULL;
+                for (size_t i = 0; i < n; ++i) {
+                        h ^= (unsigned char)s[i];
+                        h *= 1099511628211ULL;
                 }
-                topWord.reset(new Word(*sortedByWeight[top]));
-
-                return topWord;
+                return h;
         }
 
-        friend ostream& operator<<(ostream& os, const Word& w) {
-                os << w.word_ << endl << w.weight_ << endl;
-                os << w.characteristics_.size() << endl;
-                for (auto& x : w.characteristics_) {
-                        os << x << endl;
-                }
+        // Block b holds 2^(b + FIRST_BLOCK) tokens.
+        static const int FIRST_BLOCK = 10;
+        unique_ptr<string[]> blocks_[33 - FIRST_BLOCK];
+        size_t size_ = 0;
+        vector<uint32_t> table_; // Open addressing, power of 2.
+        size_t bytes_ = 0; // Blocks and the text of the tokens.
+        size_t limit_ = numeric_limits<size_t>::max();
+
+private:
+        static int block(uint32_t id, size_t& offset)
+        {
+                uint64_t x = uint64_t(id) + (1 << FIRST_BLOCK);
+                int b = 63 - __builtin_clzll(x);
+                offset = x - (uint64_t(1) << b);
+                return b - FIRST_BLOCK;
+        }
 
-                os << w.chain_.size() << endl;
-                for (auto& x : w.chain_) {
-                        os << x.first << endl << *x.second;
+        string& at(uint32_t id)
+        {
+                size_t offset = 0;
+                int b = block(id, offset);
+                if (!blocks_[b]) {
+                        size_t size = size_t(1) << (b + FIRST_BLOCK);
+                        blocks_[b].reset(new string[size]);
+                        bytes_ += size * sizeof(string);
                 }
-                return os;
+                return blocks_[b][offset];
         }
 
-        friend istream& operator>>(istream& is, Word& w) {
-                is >> w.word_ >> w.weight_;
-
-                size_t size;
-                is >> size;
-                for (int i = 0; i < size; ++i) {
-                        string c;
-                        is >> c;
-                        w.characteristics_.insert(c);
-                }
+        bool equals(uint32_t id, const char* s, size_t n) const
+        {
+                const string& t = str(id);
+                return t.size() == n && memcmp(t.data(), s, n) == 0;
+        }
 
-                is >> size;
-                for (int i = 0; i < size; ++i) {
-                        string key;
-                        unique_ptr<Word> temp(new Word());
-                        is >> key >> *temp;
-                        w.chain_.insert(
-                                pair<string, unique_ptr<Word> >(key, move(temp)));
+        void rehash(size_t size)
+        {
+                table_.assign(size, NPOS);
+                size_t mask = size - 1;
+                for (uint32_t id = 0; id < size_; ++id) {
+                        const string& t = str(id);
+                        size_t i = hash(t.data(), t.size()) & mask;
+                        while (table_[i] != NPOS)
+                                i = (i + 1) & mask;
+                        table_[i] = id;
                 }
-
-                return is;
         }
+};
 
-        map<string, unique_ptr<Word> > chain_;
-        unordered_set<string> characteristics_;
+inline Symbols& symbols()
+{
+        static Symbols s;
+        return s;
+}
+
+/*
+ * A word read from input along with what we know about it. The chains
+ * themselves live in the Model.
+ */
+struct Word {
+        Word() : id_(NPOS), characteristics_(0) {}
+        Word(const string& txt) : id_(symbols().intern(txt)),
+                characteristics_(0) {}
 
-        string word_;
-        int weight_ = 1;
+        const string& str() const { return symbols().str(id_); }
 
+        uint32_t id_;
+        uint8_t characteristics_;
 };
 
 #endif // WORD_H